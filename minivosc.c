@@ -33,11 +33,13 @@
  *
  */
 
-static int debug = 1;
+static int debug;
 /* Use our own dbg macro http://www.n1ywb.com/projects/darts/darts-usb/darts-usb.c*/
+/* both are behind a static key (see minivosc_debug_key below), so they cost
+ * nothing unless debug is set; the hot paths use tracepoints instead */
 #undef dbg
-#define dbg(format, arg...) do { if (debug) printk(KERN_DEBUG __FILE__ ": " format "\n" , ## arg); } while (0)
-#define dbg2(format, arg...) do { if (debug) printk( ": " format "\n" , ## arg); } while (0)
+#define dbg(format, arg...) do { if (static_key_false(&minivosc_debug_key)) printk(KERN_DEBUG __FILE__ ": " format "\n" , ## arg); } while (0)
+#define dbg2(format, arg...) do { if (static_key_false(&minivosc_debug_key)) printk( ": " format "\n" , ## arg); } while (0)
 
 
 /* Here is our user defined breakpoint to */
@@ -50,99 +52,572 @@ static int debug = 1;
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/jiffies.h>
+#include <linux/cpumask.h>
+#include <linux/kref.h>
+#include <linux/kthread.h>
+#include <linux/hrtimer.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include <linux/static_key.h>
+#include <linux/timex.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/time.h>
 #include <linux/wait.h>
 #include <linux/moduleparam.h>
 #include <linux/platform_device.h>
+#include <linux/uaccess.h>
+#include <asm/unaligned.h>
 #include <sound/core.h>
 #include <sound/control.h>
+#include <sound/hwdep.h>
 #include <sound/pcm.h>
+#include <sound/info.h>
 #include <sound/initval.h>
 #include <linux/version.h>
+#ifdef CONFIG_X86
+#include <asm/cpufeature.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,2,0)
+#include <asm/i387.h>
+#else
+#include <asm/fpu/api.h>
+#endif
+#endif
+
+#include "minivosc_core.h"
+
+#define CREATE_TRACE_POINTS
+#include "minivosc_trace.h"
 
 MODULE_AUTHOR("sdaau");
 MODULE_DESCRIPTION("minivosc soundcard");
 MODULE_LICENSE("GPL");
 MODULE_SUPPORTED_DEVICE("{{ALSA,minivosc soundcard}}");
 
+// dbg()/dbg2() output, switched at runtime through the debug parameter
+static struct static_key minivosc_debug_key = STATIC_KEY_INIT_FALSE;
+
+static int minivosc_debug_set(const char *val, const struct kernel_param *kp)
+{
+	int ret = param_set_int(val, kp);
+
+	if (ret < 0)
+		return ret;
+	if (debug && !static_key_enabled(&minivosc_debug_key))
+		static_key_slow_inc(&minivosc_debug_key);
+	else if (!debug && static_key_enabled(&minivosc_debug_key))
+		static_key_slow_dec(&minivosc_debug_key);
+	return 0;
+}
+
+static const struct kernel_param_ops minivosc_debug_ops = {
+	.set = minivosc_debug_set,
+	.get = param_get_int,
+};
+
+module_param_cb(debug, &minivosc_debug_ops, &debug, 0644);
+MODULE_PARM_DESC(debug, "Debug messages via printk (0 = off); use the minivosc tracepoints for the data path.");
+
 static int index[SNDRV_CARDS] = SNDRV_DEFAULT_IDX;	/* Index 0-MAX */
 static char *id[SNDRV_CARDS] = SNDRV_DEFAULT_STR;	/* ID for this card */
 static int enable[SNDRV_CARDS] = {1, [1 ... (SNDRV_CARDS - 1)] = 0};
+static int cards;	/* 0: as enable says */
+static int wave[SNDRV_CARDS];	/* MINIVOSC_WAVE_TABLE */
+static int freq[SNDRV_CARDS] = {[0 ... (SNDRV_CARDS - 1)] = 1000};
+static int amplitude[SNDRV_CARDS] = {[0 ... (SNDRV_CARDS - 1)] = 100};
+static int pcm_devs[SNDRV_CARDS] = {[0 ... (SNDRV_CARDS - 1)] = 1};
+static char *profiles[SNDRV_CARDS];	/* minivosc_profiles names, per device */
+static int pcm_substreams[SNDRV_CARDS] = {[0 ... (SNDRV_CARDS - 1)] = 1};
+static int max_buffer_kb[SNDRV_CARDS] = {[0 ... (SNDRV_CARDS - 1)] = 4096};
+static int min_period_frames[SNDRV_CARDS] = {[0 ... (SNDRV_CARDS - 1)] = 16};
+static int max_period_frames[SNDRV_CARDS] = {[0 ... (SNDRV_CARDS - 1)] = 65536};
+static bool lazy[SNDRV_CARDS];
+static int latency_probe[SNDRV_CARDS];
+static int probe_channel[SNDRV_CARDS] = {[0 ... (SNDRV_CARDS - 1)] = -1};
+static char *fill_engine = "memcpy";
+static bool buffer_marks;
+static bool fill_thread;
+static char *fill_cpus;
+static int fill_prio = 50;	/* as threaded interrupts */
+
+module_param(cards, int, 0444);
+MODULE_PARM_DESC(cards, "Number of cards, the first ones enabled (1-SNDRV_CARDS; 0 = as enable says).");
+module_param_array(wave, int, NULL, 0444);
+MODULE_PARM_DESC(wave, "Waveform (0 = table, 1 = sine, 2 = square, 3 = saw, 4 = triangle).");
+module_param_array(freq, int, NULL, 0444);
+MODULE_PARM_DESC(freq, "Oscillator frequency in Hz.");
+module_param_array(amplitude, int, NULL, 0444);
+MODULE_PARM_DESC(amplitude, "Oscillator amplitude in percent of full scale.");
+module_param_array(pcm_devs, int, NULL, 0444);
+MODULE_PARM_DESC(pcm_devs, "PCM devices # (1-8) for minivosc driver.");
+module_param_array(profiles, charp, NULL, 0444);
+MODULE_PARM_DESC(profiles, "Profiles of the PCM devices, ':' separated (default, narrowband, line, array).");
+module_param_array(pcm_substreams, int, NULL, 0444);
+MODULE_PARM_DESC(pcm_substreams, "Playback/capture substream pairs # (1-32) for minivosc driver.");
+module_param_array(max_buffer_kb, int, NULL, 0444);
+MODULE_PARM_DESC(max_buffer_kb, "Largest buffer per substream in KiB (4-65536).");
+module_param_array(min_period_frames, int, NULL, 0444);
+MODULE_PARM_DESC(min_period_frames, "Smallest period in frames (16-65536).");
+module_param_array(max_period_frames, int, NULL, 0444);
+MODULE_PARM_DESC(max_period_frames, "Largest period in frames (16-65536).");
+module_param_array(lazy, bool, NULL, 0444);
+MODULE_PARM_DESC(lazy, "Generate capture data only when the application reads it.");
+module_param_array(latency_probe, int, NULL, 0444);
+MODULE_PARM_DESC(latency_probe, "Frames between capture timestamp records (0 = off; not with lazy).");
+module_param_array(probe_channel, int, NULL, 0444);
+MODULE_PARM_DESC(probe_channel, "Channel carrying the timestamp records (-1 = whole frames).");
+module_param(fill_engine, charp, 0444);
+MODULE_PARM_DESC(fill_engine, "Fill engine (memcpy, words, live, sse2, v1, v2, v3; auto = fastest).");
+module_param(buffer_marks, bool, 0644);
+MODULE_PARM_DESC(buffer_marks, "Mark buffer and fill boundaries in the capture data (debug).");
+module_param(fill_thread, bool, 0444);
+MODULE_PARM_DESC(fill_thread, "Generate in per-CPU kernel threads instead of the timer callback.");
+module_param(fill_cpus, charp, 0444);
+MODULE_PARM_DESC(fill_cpus, "CPUs of the fill threads, as a list (e.g. 2-3; default: all online).");
+module_param(fill_prio, int, 0444);
+MODULE_PARM_DESC(fill_prio, "SCHED_FIFO priority of the fill threads (1-99; 0 = SCHED_NORMAL).");
 
 static struct platform_device *devices[SNDRV_CARDS];
 
-#define byte_pos(x)	((x) / HZ)
-#define frac_pos(x)	((x) * HZ)
-
-#define MAX_BUFFER (32 * 48)
+#define MAX_PCM_DEVS	8
+#define MAX_PCM_SUBSTREAMS	32
+#define MINIVOSC_MAX_FREQ	192000 // Hz; the oscillator stays below Nyquist anyway
+#define MAX_CHANNELS	MINIVOSC_MAX_CHANNELS // 32
+#define MAX_FRAME_BYTES	(MAX_CHANNELS * 4) // S24_LE, S32_LE, FLOAT_LE are 4 bytes
+// period and buffer limits; the module parameters narrow them per card
+#define MIN_PERIOD_FRAMES	16
+#define MAX_PERIOD_FRAMES	65536
+#define MAX_PERIOD_BYTES (MAX_PERIOD_FRAMES * MAX_FRAME_BYTES)
+#define MIN_BUFFER_KB	4
+#define MAX_BUFFER_KB	(64 * 1024)
+#define MAX_BUFFER	(MAX_BUFFER_KB * 1024)
+// audio timestamps from the position engine, through the wall clock op
+// (3.8 on; the driver builds up to 3.15, see README)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,8,0)
+#define MINIVOSC_INFO_ATIME	SNDRV_PCM_INFO_HAS_WALL_CLOCK
+#else
+#define MINIVOSC_INFO_ATIME	0
+#endif
 static struct snd_pcm_hardware minivosc_pcm_hw =
 {
 	.info = (SNDRV_PCM_INFO_MMAP |
 	SNDRV_PCM_INFO_INTERLEAVED |
 	SNDRV_PCM_INFO_BLOCK_TRANSFER |
-	SNDRV_PCM_INFO_MMAP_VALID),
-	.formats          = SNDRV_PCM_FMTBIT_U8,
-	.rates            = SNDRV_PCM_RATE_8000,
+	SNDRV_PCM_INFO_MMAP_VALID |
+	SNDRV_PCM_INFO_NO_PERIOD_WAKEUP |
+	MINIVOSC_INFO_ATIME),
+	.formats          = (SNDRV_PCM_FMTBIT_U8 |
+	SNDRV_PCM_FMTBIT_S16_LE |
+	SNDRV_PCM_FMTBIT_S24_LE |
+	SNDRV_PCM_FMTBIT_S32_LE |
+	SNDRV_PCM_FMTBIT_FLOAT_LE),
+	// no SNDRV_PCM_RATE_384000 bit in older kernels - continuous covers it
+	.rates            = SNDRV_PCM_RATE_CONTINUOUS | SNDRV_PCM_RATE_8000_192000,
 	.rate_min         = 8000,
-	.rate_max         = 8000,
+	.rate_max         = 384000,
 	.channels_min     = 1,
-	.channels_max     = 1,
-	.buffer_bytes_max = MAX_BUFFER, //(32 * 48) = 1536,
-	.period_bytes_min = 48,
-	.period_bytes_max = 48,
+	.channels_max     = MAX_CHANNELS,
+	.buffer_bytes_max = MAX_BUFFER,
+	.period_bytes_min = MIN_PERIOD_FRAMES, // of 1 byte frames, see _open
+	.period_bytes_max = MAX_PERIOD_BYTES,
 	.periods_min      = 1,
-	.periods_max      = 32,
+	.periods_max      = 1024,
+};
+
+/*
+ * what a PCM device of the card looks like (see the profiles
+ * parameter): narrows minivosc_pcm_hw and the period limits of the
+ * card, and sets the generator the device starts with. Zero (or -1,
+ * for wave) leaves that to the card.
+ */
+struct minivosc_profile
+{
+	const char *name;
+	u64 formats;		/* SNDRV_PCM_FMTBIT_* */
+	unsigned int rate_min, rate_max;
+	unsigned int channels_min, channels_max;
+	unsigned int period_min, period_max;	/* in frames */
+	int wave;		/* MINIVOSC_WAVE_* */
+	unsigned int freq;	/* in Hz */
+};
+
+static const struct minivosc_profile minivosc_profiles[] =
+{
+	{ .name = "default", .wave = -1 },
+	// a telephony mic: 10-20 ms periods
+	{ .name = "narrowband",
+	  .formats = SNDRV_PCM_FMTBIT_S16_LE,
+	  .rate_min = 8000, .rate_max = 8000,
+	  .channels_min = 1, .channels_max = 1,
+	  .period_min = 80, .period_max = 160,
+	  .wave = MINIVOSC_WAVE_SINE, .freq = 400 },
+	{ .name = "line",
+	  .formats = SNDRV_PCM_FMTBIT_S16_LE | SNDRV_PCM_FMTBIT_S24_LE |
+	             SNDRV_PCM_FMTBIT_S32_LE,
+	  .rate_min = 44100, .rate_max = 48000,
+	  .channels_min = 2, .channels_max = 2,
+	  .wave = MINIVOSC_WAVE_SINE, .freq = 997 },
+	// a microphone array
+	{ .name = "array",
+	  .formats = SNDRV_PCM_FMTBIT_S32_LE | SNDRV_PCM_FMTBIT_FLOAT_LE,
+	  .rate_min = 48000, .rate_max = 48000,
+	  .channels_min = MAX_CHANNELS, .channels_max = MAX_CHANNELS,
+	  .wave = -1 },
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,6,0)
+// past 8 channels, no positions are told - but there must be a map
+// for every channel count, or reading it fails
+#define MINIVOSC_CHMAP_UNKNOWN(n)	{ .channels = (n) } // all SNDRV_CHMAP_UNKNOWN
+
+// the usual layouts up to 7.1, and up to MAX_CHANNELS unknown ones
+static const struct snd_pcm_chmap_elem minivosc_chmaps[] = {
+	{ .channels = 1,
+	  .map = { SNDRV_CHMAP_MONO } },
+	{ .channels = 2,
+	  .map = { SNDRV_CHMAP_FL, SNDRV_CHMAP_FR } },
+	{ .channels = 3,
+	  .map = { SNDRV_CHMAP_FL, SNDRV_CHMAP_FR, SNDRV_CHMAP_FC } },
+	{ .channels = 4,
+	  .map = { SNDRV_CHMAP_FL, SNDRV_CHMAP_FR,
+	           SNDRV_CHMAP_RL, SNDRV_CHMAP_RR } },
+	{ .channels = 5,
+	  .map = { SNDRV_CHMAP_FL, SNDRV_CHMAP_FR,
+	           SNDRV_CHMAP_RL, SNDRV_CHMAP_RR, SNDRV_CHMAP_FC } },
+	{ .channels = 6,
+	  .map = { SNDRV_CHMAP_FL, SNDRV_CHMAP_FR,
+	           SNDRV_CHMAP_RL, SNDRV_CHMAP_RR,
+	           SNDRV_CHMAP_FC, SNDRV_CHMAP_LFE } },
+	{ .channels = 7,
+	  .map = { SNDRV_CHMAP_FL, SNDRV_CHMAP_FR,
+	           SNDRV_CHMAP_RL, SNDRV_CHMAP_RR,
+	           SNDRV_CHMAP_FC, SNDRV_CHMAP_LFE, SNDRV_CHMAP_RC } },
+	{ .channels = 8,
+	  .map = { SNDRV_CHMAP_FL, SNDRV_CHMAP_FR,
+	           SNDRV_CHMAP_RL, SNDRV_CHMAP_RR,
+	           SNDRV_CHMAP_FC, SNDRV_CHMAP_LFE,
+	           SNDRV_CHMAP_SL, SNDRV_CHMAP_SR } },
+	MINIVOSC_CHMAP_UNKNOWN(9), MINIVOSC_CHMAP_UNKNOWN(10),
+	MINIVOSC_CHMAP_UNKNOWN(11), MINIVOSC_CHMAP_UNKNOWN(12),
+	MINIVOSC_CHMAP_UNKNOWN(13), MINIVOSC_CHMAP_UNKNOWN(14),
+	MINIVOSC_CHMAP_UNKNOWN(15), MINIVOSC_CHMAP_UNKNOWN(16),
+	MINIVOSC_CHMAP_UNKNOWN(17), MINIVOSC_CHMAP_UNKNOWN(18),
+	MINIVOSC_CHMAP_UNKNOWN(19), MINIVOSC_CHMAP_UNKNOWN(20),
+	MINIVOSC_CHMAP_UNKNOWN(21), MINIVOSC_CHMAP_UNKNOWN(22),
+	MINIVOSC_CHMAP_UNKNOWN(23), MINIVOSC_CHMAP_UNKNOWN(24),
+	MINIVOSC_CHMAP_UNKNOWN(25), MINIVOSC_CHMAP_UNKNOWN(26),
+	MINIVOSC_CHMAP_UNKNOWN(27), MINIVOSC_CHMAP_UNKNOWN(28),
+	MINIVOSC_CHMAP_UNKNOWN(29), MINIVOSC_CHMAP_UNKNOWN(30),
+	MINIVOSC_CHMAP_UNKNOWN(31), MINIVOSC_CHMAP_UNKNOWN(32),
+	{ }
+};
+#endif
+
+struct minivosc_pcm;
+
+/*
+ * fill engine: how the timer path writes the capture buffer - chosen
+ * at load time by name, or by benchmarking them (fill_engine=auto)
+ */
+struct minivosc_engine
+{
+	const char *name;
+	// writes bytes at buf_pos, wrapping around the buffer
+	void (*fill)(struct minivosc_pcm *mypcm, unsigned int bytes);
+	bool (*usable)(void);	/* CPU support; NULL if any CPU will do */
+	u64 formats;		/* SNDRV_PCM_FMTBIT_*; 0 for all */
+	unsigned int flags;	/* MINIVOSC_ENGINE_* */
+};
+
+#define MINIVOSC_ENGINE_IMAGE	1 // copies from the prerendered image
+#define MINIVOSC_ENGINE_OWN_POS	2 // moves buf_pos itself
+#define MINIVOSC_ENGINE_LEGACY	4 // the old wvfdat walkers (U8 mono), not benchmarked
+
+
+/*
+ * PCM buffer: vmalloc'ed, and refcounted, since a capture substream
+ * may use the buffer of its playback peer (see minivosc_loop_share)
+ */
+struct minivosc_buf
+{
+	struct kref ref;
+	char *area;
+	size_t bytes;
+};
+
+/*
+ * signal image, shared by all substreams (of all cards) whose signals
+ * have the same key and need no more of it: rendered once, read only
+ * after that, and freed with its last user
+ */
+struct minivosc_image
+{
+	struct list_head list;	/* in minivosc_images */
+	unsigned int users;	/* under minivosc_images_lock */
+	unsigned int bytes;
+	char *data;
+	struct minivosc_image_key key;
+};
+
+static LIST_HEAD(minivosc_images);
+static DEFINE_MUTEX(minivosc_images_lock);	/* the list, and users */
+
+/*
+ * the playback and capture substream of the same subdevice number;
+ * while both run with the same format, rate and channels, what is
+ * played shows up on the capture side (as in aloop-kernel.c)
+ */
+struct minivosc_cable
+{
+	spinlock_t lock;	/* the loop state of both streams[], and ring */
+	struct minivosc_pcm *streams[2];	/* open substreams, by SNDRV_PCM_STREAM_* */
+	struct minivosc_ring *ring;	/* feeds the capture, if attached */
+};
+
+/*
+ * injection ring of a capture subdevice (see minivosc_inject.h): the
+ * control page and the data in one vmalloc_user area. Refcounted, as
+ * the mappings of the producer may outlive its attachment; attached
+ * and detached under cable_lock.
+ */
+struct minivosc_ring
+{
+	struct kref ref;
+	char *area;
+	size_t bytes;
+	struct file *owner;	/* the hwdep file it was set up through */
+	struct minivosc_inject inj;	/* the consumer, under cable->lock */
+};
+
+// per channel oscillator parameters
+enum {
+	MINIVOSC_CHAN_FREQ,	// in Hz, 0 = that of the card
+	MINIVOSC_CHAN_AMP,	// in percent of that of the card
+	MINIVOSC_CHAN_PHASE,	// in degrees
+	MINIVOSC_CHAN_PARAMS
+};
+
+/*
+ * generator parameters of a PCM device, as set by the mixer controls: the
+ * fill path only reads them under RCU, the controls replace the whole
+ * block (under params_lock), and the old one goes after a grace period
+ */
+struct minivosc_params
+{
+	struct rcu_head rcu;
+	unsigned int seq;	/* changes with every update */
+	unsigned int wave;	/* MINIVOSC_WAVE_* */
+	unsigned int freq;	/* in Hz */
+	unsigned int amp;	/* in percent of full scale */
+	int lift;		/* DC offset, in percent of full scale */
+	unsigned int mute;
+	/* per channel: see the ch_* of minivosc_signal */
+	unsigned int chan[MINIVOSC_CHAN_PARAMS][MAX_CHANNELS];
 };
 
+/*
+ * a PCM device of the card (hw:X,index), with the hardware and the
+ * generator of its profile
+ */
+struct minivosc_pcm_device
+{
+	struct minivosc_device *mydev;
+	unsigned int index;
+	struct snd_pcm *pcm;
+	const struct minivosc_profile *profile;
+	/* what newly opened substreams get: the card limits, narrowed */
+	struct snd_pcm_hardware hw;
+	unsigned int min_period_frames;
+	unsigned int max_period_frames;
+	/* oscillator parameters, for all of its capture substreams */
+	struct minivosc_params __rcu *params;
+	/* one cable per subdevice number: playback N loops into capture N */
+	struct minivosc_cable cables[MAX_PCM_SUBSTREAMS];
+};
 
 struct minivosc_device
 {
 	struct snd_card *card;
-	struct snd_pcm *pcm;
 	const struct minivosc_pcm_ops *timer_ops;
-	/*
-	* we have only one substream, so all data in this struct
-	*/
 	/* copied from struct loopback: */
+	/* the sleepable setup only - buffers, rings, who is open; never
+	 * taken by trigger, pointer or the timer, see minivosc_pcm */
 	struct mutex cable_lock;
+	/* geometry limits of the card; the devices narrow them */
+	unsigned int max_buffer_bytes;
+	unsigned int min_period_frames;
+	unsigned int max_period_frames;
+	bool lazy;	/* capture generates in copy/ack, as it is read */
+	unsigned int probe_interval;	/* latency probe records; 0 = off */
+	int probe_channel;
+	struct mutex params_lock;	/* serializes the updates, of all devs */
+	struct minivosc_pcm_device devs[MAX_PCM_DEVS];
+	unsigned int nr_devs;
+};
+
+// timer lateness histogram: upper bounds of the buckets, in us
+static const unsigned int minivosc_late_us[] = { 10, 50, 100, 500, 1000, 5000 };
+#define MINIVOSC_LATE_BUCKETS	(ARRAY_SIZE(minivosc_late_us) + 1)
+
+/*
+ * per substream statistics, one copy per CPU so the hot path never
+ * bounces a cache line; summed up only when read
+ */
+struct minivosc_stats
+{
+	u64 wakeups;		/* timer callbacks that serviced us */
+	u64 late[MINIVOSC_LATE_BUCKETS];	/* actual - expected wakeup */
+	u64 bytes;		/* generated, or looped */
+	u64 periods;		/* snd_pcm_period_elapsed calls */
+	u64 catchups;		/* position updates across > 1 period */
+	u64 fills;
+	u64 fill_cycles;	/* get_cycles() spent in xfer_buf */
+};
+
+/*
+ * one hrtimer per CPU serves all running substreams of all cards,
+ * whose substreams were started on that CPU: each callback fills
+ * every substream whose period has ended, then does all of their
+ * snd_pcm_period_elapsed() calls in one batch. The timer is pinned,
+ * and only ever armed from its own CPU, so it stays there.
+ *
+ * With fill_thread, the callback only wakes a kernel thread bound to
+ * that CPU, which does the same in process context (at fill_prio),
+ * and re-arms the timer; only the CPUs of fill_cpus have one, and
+ * take the substreams started elsewhere round robin.
+ */
+struct minivosc_sched
+{
+	spinlock_t lock;
+	struct hrtimer timer;
+	struct list_head streams;	/* running minivosc_pcm */
+	struct task_struct *thread;	/* with fill_thread */
+	unsigned long kick;	/* the timer went off, for the thread */
+	struct mutex run_lock;	/* held by the thread while servicing */
+	int cpu;
+};
+
+static DEFINE_PER_CPU(struct minivosc_sched, minivosc_sched);
+static cpumask_var_t minivosc_fill_mask;	/* CPUs with a fill thread */
+
+// the most a callback fills for a substream, in bytes (whole frames,
+// at least one): a timer late by a lot, or a huge period, is caught up
+// with over more callbacks, MINIVOSC_CATCHUP_NS apart, not all in one
+// go with interrupts off
+#define MINIVOSC_FILL_BYTES	(64 * 1024)
+#define MINIVOSC_CATCHUP_NS	(50 * NSEC_PER_USEC)
+
+// without period wakeups (and nothing fed at the pace of the timer),
+// the timer comes every half buffer only, and the stream runs on this
+// much further (up to a quarter buffer), for its lateness
+#define MINIVOSC_NOWAKE_MARGIN_NS	(2 * NSEC_PER_MSEC)
+
+/*
+ * where the stream is, as of the last position update, and how far
+ * the clock alone may move it on: what _pointer and the audio
+ * timestamps report, so they never move the position (or generate)
+ * themselves
+ */
+struct minivosc_snap
+{
+	unsigned int pos;	/* in the buffer, in bytes */
+	u64 frames;		/* ... and in frames since the start */
+	ktime_t time;		/* when the position reached that frame */
+	unsigned int ahead;	/* frames filled (or free) past it */
+};
+
+#define CABLE_PLAYBACK	(1 << SNDRV_PCM_STREAM_PLAYBACK)
+#define CABLE_CAPTURE	(1 << SNDRV_PCM_STREAM_CAPTURE)
+#define CABLE_BOTH	(CABLE_PLAYBACK | CABLE_CAPTURE)
+
+/*
+ * per substream state - each capture substream has its own
+ * position engine, timer and generator
+ *
+ * Locking, outermost first:
+ *  - sched->lock: the substream being in sched->streams (that is,
+ *    serviced by the timer), expires, sched_list and batch_list
+ *  - lock: the stream state - running, the geometry, pos, last_time,
+ *    buf_pos and the generator (but for lazy read(), which copy owns,
+ *    and the fill thread, which generates what it claimed without it);
+ *    taken by prepare, trigger and the timer callback (or fill
+ *    thread), which is the only one to move the position - always
+ *    with interrupts off, as trigger may come from interrupt context
+ *  - cable->lock: the loop state, and running as the peer sees it
+ * _pointer takes none, it reads snap (see minivosc_snap_read); the
+ * peer of a loop reads buf_pos from there too.
+ */
+struct minivosc_pcm
+{
+	struct minivosc_device *mydev;
+	struct minivosc_pcm_device *pcmdev;
+	struct minivosc_cable *cable;
+	spinlock_t lock;
 	/* copied from struct loopback_cable: */
 	/* PCM parameters */
-	unsigned int pcm_period_size;
-	unsigned int pcm_bps;		/* bytes per second */
+	unsigned int pcm_period_size;	/* in bytes */
+	unsigned int pcm_frame_bytes;
+	unsigned int pcm_channels;
 	/* flags */
 	unsigned int valid;
 	unsigned int running;
 	unsigned int period_update_pending :1;
 	/* timer stuff */
-	unsigned int irq_pos;		/* fractional IRQ position */
-	unsigned int period_size_frac;
-	unsigned long last_jiffies;
-	struct timer_list timer;
+	struct minivosc_pos pos;	/* rate, period and fractional position */
+	ktime_t last_time;	/* time of the last position update */
+	unsigned int no_wakeup :1;	/* no period_elapsed */
+	unsigned int nowake_span;	/* frames from one timer to the next,
+					 * without wakeups; 0: period ends */
+	unsigned int catchup :1;	/* filling left to do: come back soon */
+	seqcount_t snap_seq;	/* publishing snap, from the timer */
+	struct minivosc_snap snap;
+	struct minivosc_snap ptr_snap;	/* read by the last _pointer */
+	ktime_t expires;	/* end of the current period */
+	ktime_t next_expires;	/* the fill thread's, until under sched->lock */
+	struct minivosc_sched *sched;	/* timer serving this substream */
+	struct list_head sched_list;	/* in sched->streams while running */
+	struct list_head batch_list;	/* period elapsed batch of a callback */
+	struct minivosc_stats __percpu *stats;
 	/* copied from struct loopback_pcm: */
 	struct snd_pcm_substream *substream;
+	struct minivosc_buf *buf;	/* runtime->dma_area, under cable_lock */
 	unsigned int pcm_buffer_size;
 	unsigned int buf_pos;	/* position in buffer */
+	u64 head;		/* frames filled (or played) since the start:
+				 * ahead of pos.frames, or behind it */
 	unsigned int silent_size;
+	/* loopback (under cable->lock): */
+	unsigned int looped :1;		/* fed by the playback substream, or
+					 * for that, feeding the capture one */
+	unsigned int loop_shared :1;	/* uses the playback buffer itself */
+	unsigned int loop_pos;		/* where the played data goes */
 	/* added for waveform: */
-	unsigned int wvf_pos;	/* position in waveform array */
-	unsigned int wvf_lift;	/* lift of waveform array */
+	struct minivosc_signal sig;	/* oscillator and signal image */
+	struct minivosc_image *image;	/* the image sig copies from */
+	const struct minivosc_engine *engine;	/* capture fill engine */
+	/* lazy mode (capture only): the timer just moves the position, and
+	 * with mmap, generates a period ahead of it */
+	unsigned int lazy :1;
+	snd_pcm_uframes_t lazy_done;	/* mmap: the frame (as appl_ptr
+					 * counts) up to which the buffer is
+					 * generated */
+	char *lazy_bounce;	/* read: one block, on its way to the user */
+	struct minivosc_probe probe;	/* capture timestamp records */
+	unsigned int params_seq;	/* of the parameters sig has */
 };
 
-// waveform
-#if defined(COPYALG_V1) || defined(COPYALG_V2) || defined(COPYALG_V3)
-static char wvfdat[]={	20, 22, 24, 25, 24, 22, 21,
-			19, 17, 15, 14, 15, 17, 19,
-			20, 127, 22, 19, 17, 15, 19};
-#endif
-#if defined(COPYALG_V1) || defined(COPYALG_V2)
-static char wvfdat2[]={	20, 22, 24, 25, 24, 22, 21,
+// waveform - never changed: the engines that lift it (v1, v2) do so
+// in a copy of their own, as all substreams fill at the same time
+static const char wvfdat[WVF_SIZE]={	20, 22, 24, 25, 24, 22, 21,
 			19, 17, 15, 14, 15, 17, 19,
 			20, 127, 22, 19, 17, 15, 19};
-#endif
-#if defined(COPYALG_V1) || defined(COPYALG_V2) || defined(COPYALG_V3)
 static unsigned int wvfsz=sizeof(wvfdat);//*sizeof(float) is included already
-#endif
 // * functions for driver/kernel module initialization
 static void minivosc_unregister_all(void);
 static int __init alsa_card_minivosc_init(void);
@@ -165,20 +640,55 @@ static int minivosc_hw_free(struct snd_pcm_substream *ss);
 static int minivosc_pcm_open(struct snd_pcm_substream *ss);
 static int minivosc_pcm_close(struct snd_pcm_substream *ss);
 static int minivosc_pcm_prepare(struct snd_pcm_substream *ss);
+static struct page *minivosc_pcm_page(struct snd_pcm_substream *ss,
+                                      unsigned long offset);
+static int minivosc_pcm_copy(struct snd_pcm_substream *ss, int channel,
+                             snd_pcm_uframes_t pos, void __user *buf,
+                             snd_pcm_uframes_t count);
+static int minivosc_pcm_ack(struct snd_pcm_substream *ss);
+static void minivosc_lazy_fill(struct minivosc_pcm *mypcm,
+                               snd_pcm_uframes_t target);
 static int minivosc_pcm_trigger(struct snd_pcm_substream *ss,
                           int cmd);
 static snd_pcm_uframes_t minivosc_pcm_pointer(struct snd_pcm_substream *ss);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,8,0)
+static int minivosc_pcm_wall_clock(struct snd_pcm_substream *ss,
+                                   struct timespec *audio_ts);
+#endif
 
 static int minivosc_pcm_dev_free(struct snd_device *device);
 static int minivosc_pcm_free(struct minivosc_device *chip);
+static int minivosc_mixer_new(struct minivosc_pcm_device *pcmdev);
+static int minivosc_inject_new(struct minivosc_pcm_device *pcmdev);
+static void minivosc_params_load(struct minivosc_pcm *mypcm);
+static void minivosc_params_apply(struct minivosc_pcm *mypcm);
 
 // * declare timer functions - copied from aloop-kernel.c
-static void minivosc_timer_start(struct minivosc_device *mydev);
-static void minivosc_timer_stop(struct minivosc_device *mydev);
-static void minivosc_pos_update(struct minivosc_device *mydev);
-static void minivosc_timer_function(unsigned long data);
-static void minivosc_xfer_buf(struct minivosc_device *mydev, unsigned int count);
-static void minivosc_fill_capture_buf(struct minivosc_device *mydev, unsigned int bytes);
+static int minivosc_sched_init(void);
+static void minivosc_sched_exit(void);
+static void minivosc_proc_init(struct minivosc_device *mydev);
+static struct minivosc_sched *minivosc_sched_pick(void);
+static void minivosc_timer_start(struct minivosc_pcm *mypcm);
+static void minivosc_timer_stop(struct minivosc_pcm *mypcm);
+static void minivosc_timer_sync(struct minivosc_pcm *mypcm);
+static void minivosc_snap_publish(struct minivosc_pcm *mypcm);
+static void minivosc_snap_read(struct minivosc_pcm *mypcm,
+                               struct minivosc_snap *snap);
+static unsigned int minivosc_pos_update(struct minivosc_pcm *mypcm, bool defer);
+static enum hrtimer_restart minivosc_timer_function(struct hrtimer *timer);
+static void minivosc_xfer_buf(struct minivosc_pcm *mypcm, unsigned int count);
+static bool minivosc_loop_share(struct minivosc_pcm *mypcm,
+                                struct snd_pcm_hw_params *hw_params);
+static void minivosc_loop_unshare(struct minivosc_pcm *mypcm);
+static void minivosc_loop_recheck(struct minivosc_pcm *mypcm);
+static bool minivosc_fill_capture_buf(struct minivosc_pcm *mypcm, unsigned int bytes);
+static int minivosc_fill_setup(struct minivosc_pcm *mypcm,
+                        struct snd_pcm_runtime *runtime);
+static void minivosc_fill_free(struct minivosc_pcm *mypcm);
+static const struct minivosc_engine *minivosc_engine_for(struct snd_pcm_runtime *runtime);
+static void minivosc_engine_note(const struct snd_pcm_hardware *hw,
+                                 const char *profile);
+static int minivosc_engine_init(void);
 
 
 // note snd_pcm_ops can usually be separate _playback_ops and _capture_ops
@@ -192,6 +702,31 @@ static struct snd_pcm_ops minivosc_pcm_ops =
 	.prepare   = minivosc_pcm_prepare,
 	.trigger   = minivosc_pcm_trigger,
 	.pointer   = minivosc_pcm_pointer,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,8,0)
+	.wall_clock = minivosc_pcm_wall_clock,
+#endif
+	.page      = minivosc_pcm_page,
+};
+
+// capture in lazy mode: samples are generated in the context of the
+// application, right before it gets them (as dummy_pcm_ops_no_buf
+// in dummy.c, with a .copy of its own)
+static struct snd_pcm_ops minivosc_pcm_lazy_ops =
+{
+	.open      = minivosc_pcm_open,
+	.close     = minivosc_pcm_close,
+	.ioctl     = snd_pcm_lib_ioctl,
+	.hw_params = minivosc_hw_params,
+	.hw_free   = minivosc_hw_free,
+	.prepare   = minivosc_pcm_prepare,
+	.trigger   = minivosc_pcm_trigger,
+	.pointer   = minivosc_pcm_pointer,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,8,0)
+	.wall_clock = minivosc_pcm_wall_clock,
+#endif
+	.copy      = minivosc_pcm_copy,
+	.ack       = minivosc_pcm_ack,
+	.page      = minivosc_pcm_page,
 };
 
 // specifies what func is called @ snd_card_free
@@ -229,6 +764,165 @@ static struct platform_driver minivosc_driver =
  * Probe/remove functions
  *
  */
+// the profile called name; NULL if there is none (no name: default)
+static const struct minivosc_profile *minivosc_profile_find(const char *name)
+{
+	unsigned int i;
+
+	if (!name || !*name)
+		return &minivosc_profiles[0];
+	for (i = 0; i < ARRAY_SIZE(minivosc_profiles); i++)
+		if (!strcmp(name, minivosc_profiles[i].name))
+			return &minivosc_profiles[i];
+	return NULL;
+}
+
+// PCM device index of the card, with its mixer controls and hwdep;
+// dev is the card number, for the module parameters
+static int minivosc_pcm_dev_new(struct minivosc_device *mydev,
+                                unsigned int index,
+                                const struct minivosc_profile *prof, int dev)
+{
+	struct minivosc_pcm_device *pcmdev = &mydev->devs[index];
+	struct snd_card *card = mydev->card;
+	struct minivosc_params *params;
+	struct snd_pcm *pcm;
+	int nr_subdevs; // how many capture substreams we want
+	int i, ret;
+
+	pcmdev->mydev = mydev;
+	pcmdev->index = index;
+	pcmdev->profile = prof;
+	for (i = 0; i < MAX_PCM_SUBSTREAMS; i++)
+		spin_lock_init(&pcmdev->cables[i].lock);
+
+	// the card limits, on top of minivosc_pcm_hw, narrowed by the profile
+	pcmdev->hw = minivosc_pcm_hw;
+	pcmdev->hw.buffer_bytes_max = mydev->max_buffer_bytes;
+	if (prof->formats)
+		pcmdev->hw.formats &= prof->formats;
+	if (prof->rate_min) {
+		pcmdev->hw.rate_min = prof->rate_min;
+		pcmdev->hw.rate_max = prof->rate_max;
+	}
+	if (prof->channels_min) {
+		pcmdev->hw.channels_min = prof->channels_min;
+		pcmdev->hw.channels_max = prof->channels_max;
+	}
+	minivosc_engine_note(&pcmdev->hw, prof->name);
+
+	// the profile's periods, within the card limits: if these leave
+	// none of them, the profile is refused; narrowed, it is told
+	if ((prof->period_max && prof->period_max < mydev->min_period_frames) ||
+	    prof->period_min > mydev->max_period_frames) {
+		printk(KERN_ERR "minivosc: profile %s periods (%u-%u frames) "
+		       "outside card limits (%u-%u)\n", prof->name,
+		       prof->period_min, prof->period_max,
+		       mydev->min_period_frames, mydev->max_period_frames);
+		return -EINVAL;
+	}
+	pcmdev->min_period_frames = max(mydev->min_period_frames, prof->period_min);
+	pcmdev->max_period_frames = mydev->max_period_frames;
+	if (prof->period_max)
+		pcmdev->max_period_frames = min(prof->period_max,
+		                                mydev->max_period_frames);
+	if ((prof->period_min && pcmdev->min_period_frames != prof->period_min) ||
+	    (prof->period_max && pcmdev->max_period_frames != prof->period_max))
+		printk(KERN_WARNING "minivosc: profile %s periods narrowed "
+		       "to %u-%u frames by card limits\n", prof->name,
+		       pcmdev->min_period_frames, pcmdev->max_period_frames);
+
+	// oscillator defaults, per device; the mixer controls change them
+	params = kzalloc(sizeof(*params), GFP_KERNEL);
+	if (!params)
+		return -ENOMEM;
+	params->wave = prof->wave >= 0 ? prof->wave :
+		clamp(wave[dev], MINIVOSC_WAVE_TABLE, MINIVOSC_WAVE_TRIANGLE);
+	params->freq = prof->freq ? prof->freq : clamp(freq[dev], 1, MINIVOSC_MAX_FREQ);
+	params->amp = clamp(amplitude[dev], 0, 100);
+	for (i = 0; i < MAX_CHANNELS; i++)
+		params->chan[MINIVOSC_CHAN_AMP][i] = 100;
+	RCU_INIT_POINTER(pcmdev->params, params); // freed by minivosc_pcm_free
+
+
+	nr_subdevs = clamp(pcm_substreams[dev], 1, MAX_PCM_SUBSTREAMS); // how many substreams (cables) we want
+	// * we want nr_subdevs playback, and nr_subdevs capture substreams (4th and 5th arg) ..
+	ret = snd_pcm_new(card, card->driver, index, nr_subdevs, nr_subdevs, &pcm);
+
+	if (ret < 0)
+		return ret;
+
+
+	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &minivosc_pcm_ops);
+	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE,
+	                mydev->lazy ? &minivosc_pcm_lazy_ops : &minivosc_pcm_ops); // in both aloop-kernel.c and dummy.c, after snd_pcm_new...
+	pcm->private_data = mydev; //here it should be dev/card struct (the one containing struct snd_card *card) - this DOES NOT end up in substream->private_data
+
+	pcm->info_flags = 0;
+	if (prof == &minivosc_profiles[0])
+		strcpy(pcm->name, card->shortname);
+	else
+		snprintf(pcm->name, sizeof(pcm->name), "%s %s",
+		         card->shortname, prof->name);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,6,0)
+	// channel positions, for both directions; the oscillator channels
+	// are told apart by the per channel mixer controls
+	for (i = SNDRV_PCM_STREAM_PLAYBACK; i <= SNDRV_PCM_STREAM_LAST; i++) {
+		ret = snd_pcm_add_chmap_ctls(pcm, i, minivosc_chmaps,
+		                             pcmdev->hw.channels_max, 0, NULL);
+		if (ret < 0)
+			return ret;
+	}
+#endif
+
+	/*
+	trid to add this - but it crashes here:
+	//mydev->substream->private_data = mydev;
+	Well, first time real substream comes in, is in _open - so
+	that has to be handled there.. That is: at this point, mydev->substream is null,
+	and we first have a chance to set it ... in _open!
+	*/
+
+	// * no preallocation: buffers are vmalloc'ed at hw_params, in the
+	// * size asked for (up to max_buffer_kb), see minivosc_buf_alloc
+
+	pcmdev->pcm = pcm;
+	ret = minivosc_mixer_new(pcmdev);
+	if (ret < 0)
+		return ret;
+	return minivosc_inject_new(pcmdev);
+}
+
+// the pcm_devs PCM devices of card dev, as its profiles say
+static int minivosc_pcm_devs_new(struct minivosc_device *mydev, int dev)
+{
+	const struct minivosc_profile *prof;
+	char *names = NULL, *next, *name;
+	unsigned int i;
+	int ret = 0;
+
+	if (profiles[dev]) {
+		names = kstrdup(profiles[dev], GFP_KERNEL);
+		if (!names)
+			return -ENOMEM;
+	}
+	next = names;
+	mydev->nr_devs = clamp(pcm_devs[dev], 1, MAX_PCM_DEVS);
+	for (i = 0; i < mydev->nr_devs && ret >= 0; i++) {
+		name = next ? strsep(&next, ":") : NULL;
+		prof = minivosc_profile_find(name);
+		if (!prof) {
+			printk(KERN_ERR "minivosc: unknown profile %s\n", name);
+			ret = -EINVAL;
+			break;
+		}
+		ret = minivosc_pcm_dev_new(mydev, i, prof, dev);
+	}
+	kfree(names);
+	return ret;
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,8,0)
 static int __devinit minivosc_probe(struct platform_device *devptr)
 #else
@@ -240,9 +934,6 @@ static int minivosc_probe(struct platform_device *devptr)
 	struct minivosc_device *mydev;
 	int ret;
 
-	int nr_subdevs; // how many capture substreams we want
-	struct snd_pcm *pcm;
-
 	int dev = devptr->id; // from aloop-kernel.c
 
 	dbg("%s: probe", __func__);
@@ -259,6 +950,15 @@ static int minivosc_probe(struct platform_device *devptr)
 	mydev->card = card;
 	// MUST have mutex_init here - else crash on mutex_lock!!
 	mutex_init(&mydev->cable_lock);
+	mutex_init(&mydev->params_lock);
+	// buffer and period limits, per card
+	mydev->max_buffer_bytes = clamp(max_buffer_kb[dev], MIN_BUFFER_KB, MAX_BUFFER_KB) * 1024;
+	mydev->min_period_frames = clamp(min_period_frames[dev], MIN_PERIOD_FRAMES, MAX_PERIOD_FRAMES);
+	mydev->max_period_frames = clamp(max_period_frames[dev],
+	                                 (int)mydev->min_period_frames, MAX_PERIOD_FRAMES);
+	mydev->lazy = lazy[dev];
+	mydev->probe_interval = max(latency_probe[dev], 0);
+	mydev->probe_channel = probe_channel[dev];
 
 	dbg2("-- mydev %p", mydev);
 
@@ -275,36 +975,10 @@ static int minivosc_probe(struct platform_device *devptr)
 	if (ret < 0)
 		goto __nodev;
 
-
-	nr_subdevs = 1; // how many capture substreams we want
-	// * we want 0 playback, and 1 capture substreams (4th and 5th arg) ..
-	ret = snd_pcm_new(card, card->driver, 0, 0, nr_subdevs, &pcm);
-
-	if (ret < 0)
-		goto __nodev;
-
-
-	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &minivosc_pcm_ops); // in both aloop-kernel.c and dummy.c, after snd_pcm_new...
-	pcm->private_data = mydev; //here it should be dev/card struct (the one containing struct snd_card *card) - this DOES NOT end up in substream->private_data
-
-	pcm->info_flags = 0;
-	strcpy(pcm->name, card->shortname);
-
-	/*
-	trid to add this - but it crashes here:
-	//mydev->substream->private_data = mydev;
-	Well, first time real substream comes in, is in _open - so
-	that has to be handled there.. That is: at this point, mydev->substream is null,
-	and we first have a chance to set it ... in _open!
-	*/
-
-	ret = snd_pcm_lib_preallocate_pages_for_all(pcm,
-	        SNDRV_DMA_TYPE_CONTINUOUS,
-	        snd_dma_continuous_data(GFP_KERNEL),
-	        MAX_BUFFER, MAX_BUFFER); // in both aloop-kernel.c and dummy.c, after snd_pcm_set_ops...
-
+	ret = minivosc_pcm_devs_new(mydev, dev);
 	if (ret < 0)
 		goto __nodev;
+	minivosc_proc_init(mydev);
 
 	// * will use the snd_card_register form from aloop-kernel.c/dummy.c here..
 	ret = snd_card_register(card);
@@ -340,18 +1014,100 @@ static int minivosc_remove(struct platform_device *devptr)
  * hw alloc/free functions
  *
  */
+static void minivosc_buf_release(struct kref *ref)
+{
+	struct minivosc_buf *buf = container_of(ref, struct minivosc_buf, ref);
+
+	vfree(buf->area);
+	kfree(buf);
+}
+
+// drops the buffer of the substream; called with cable_lock held
+static void minivosc_buf_put(struct minivosc_pcm *mypcm)
+{
+	if (mypcm->buf)
+		kref_put(&mypcm->buf->ref, minivosc_buf_release);
+	mypcm->buf = NULL;
+	snd_pcm_set_runtime_buffer(mypcm->substream, NULL);
+}
+
+// makes buf the buffer of the substream, bytes of it in use;
+// called with cable_lock held
+static void minivosc_buf_set(struct minivosc_pcm *mypcm,
+                             struct minivosc_buf *buf, size_t bytes)
+{
+	struct snd_pcm_runtime *runtime = mypcm->substream->runtime;
+
+	mypcm->buf = buf;
+	runtime->dma_area = buf->area;
+	runtime->dma_addr = 0;
+	runtime->dma_bytes = bytes;
+}
+
+// as snd_pcm_lib_alloc_vmalloc_buffer(), but refcounted: keeps the
+// current buffer if it is large enough; called with cable_lock held
+static int minivosc_buf_alloc(struct minivosc_pcm *mypcm, size_t bytes)
+{
+	struct minivosc_buf *buf = mypcm->buf;
+
+	if (buf && buf->bytes >= bytes) {
+		minivosc_buf_set(mypcm, buf, bytes);
+		return 0;
+	}
+	minivosc_buf_put(mypcm);
+
+	buf = kmalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	buf->area = vmalloc_user(bytes);
+	if (!buf->area) {
+		kfree(buf);
+		return -ENOMEM;
+	}
+	kref_init(&buf->ref);
+	buf->bytes = bytes;
+	minivosc_buf_set(mypcm, buf, bytes);
+	return 0;
+}
+
 static int minivosc_hw_params(struct snd_pcm_substream *ss,
                         struct snd_pcm_hw_params *hw_params)
 {
+	struct minivosc_pcm *mypcm = ss->runtime->private_data;
+	struct minivosc_device *mydev = mypcm->mydev;
+	int ret = 0;
+
 	dbg("%s", __func__);
-	return snd_pcm_lib_malloc_pages(ss,
-	                                params_buffer_bytes(hw_params));
+	mutex_lock(&mydev->cable_lock);
+	// a buffer shared so far is not to be reused: see loop_unshare
+	minivosc_loop_unshare(mypcm);
+	if (ss->stream != SNDRV_PCM_STREAM_CAPTURE ||
+	    !minivosc_loop_share(mypcm, hw_params))
+		ret = minivosc_buf_alloc(mypcm, params_buffer_bytes(hw_params));
+	mutex_unlock(&mydev->cable_lock);
+	return ret;
 }
 
 static int minivosc_hw_free(struct snd_pcm_substream *ss)
 {
+	struct minivosc_pcm *mypcm = ss->runtime->private_data;
+	struct minivosc_device *mydev = mypcm->mydev;
+
 	dbg("%s", __func__);
-	return snd_pcm_lib_free_pages(ss);
+	minivosc_timer_sync(mypcm);
+	minivosc_fill_free(mypcm);
+	mutex_lock(&mydev->cable_lock);
+	minivosc_loop_unshare(mypcm);
+	minivosc_buf_put(mypcm);
+	mutex_unlock(&mydev->cable_lock);
+	return 0;
+}
+
+// for mmap: the buffer is not physically contiguous
+static struct page *minivosc_pcm_page(struct snd_pcm_substream *ss,
+                                      unsigned long offset)
+{
+	return vmalloc_to_page(ss->runtime->dma_area + offset);
 }
 
 
@@ -360,26 +1116,74 @@ static int minivosc_hw_free(struct snd_pcm_substream *ss)
  * PCM functions
  *
  */
+// frees the per substream state, at the end of snd_pcm_release
+static void minivosc_runtime_free(struct snd_pcm_runtime *runtime)
+{
+	struct minivosc_pcm *mypcm = runtime->private_data;
+
+	dbg("%s", __func__);
+	minivosc_fill_free(mypcm);
+	if (mypcm->buf)
+		kref_put(&mypcm->buf->ref, minivosc_buf_release);
+	kfree(mypcm->lazy_bounce);
+	free_percpu(mypcm->stats);
+	kfree(mypcm);
+}
+
 static int minivosc_pcm_open(struct snd_pcm_substream *ss)
 {
 	struct minivosc_device *mydev = ss->private_data;
+	struct minivosc_pcm_device *pcmdev = &mydev->devs[ss->pcm->device];
+	struct minivosc_pcm *mypcm;
+	int err;
 
 	//BREAKPOINT();
 	dbg("%s", __func__);
 
-	// copied from aloop-kernel.c:
-	mutex_lock(&mydev->cable_lock);
+	// the limits of the device (see minivosc_pcm_dev_new)
+	ss->runtime->hw = pcmdev->hw;
+	err = snd_pcm_hw_constraint_minmax(ss->runtime,
+	                                   SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+	                                   pcmdev->min_period_frames,
+	                                   pcmdev->max_period_frames);
+	if (err < 0)
+		return err;
 
-	ss->runtime->hw = minivosc_pcm_hw;
+	// each substream gets its own state (as loopback_pcm in aloop-kernel.c)
+	mypcm = kzalloc(sizeof(*mypcm), GFP_KERNEL);
+	if (!mypcm)
+		return -ENOMEM;
+	mypcm->stats = alloc_percpu(struct minivosc_stats);
+	if (!mypcm->stats) {
+		kfree(mypcm);
+		return -ENOMEM;
+	}
 
-	mydev->substream = ss; 	//save (system given) substream *ss, in our structure field
-	ss->runtime->private_data = mydev;
-	mydev->wvf_pos = 0; 	//init
-	mydev->wvf_lift = 0; 	//init
+	// copied from aloop-kernel.c:
+	mutex_lock(&mydev->cable_lock);
 
-	// SETUP THE TIMER HERE:
-	setup_timer(&mydev->timer, minivosc_timer_function,
-	            (unsigned long)mydev);
+	mypcm->mydev = mydev;
+	mypcm->pcmdev = pcmdev;
+	mypcm->cable = &pcmdev->cables[ss->number];
+	mypcm->substream = ss; 	//save (system given) substream *ss, in our structure field
+	mypcm->sig.wvf_pos = 0; 	//init
+	mypcm->sig.wvf_lift = 0; 	//init
+	mypcm->lazy = mydev->lazy && ss->stream == SNDRV_PCM_STREAM_CAPTURE;
+
+	// SETUP THE TIMER HERE - use the one of the CPU we are opened on
+	// (or of a fill thread, see minivosc_sched_pick); trigger picks
+	// again on start:
+	mypcm->sched = minivosc_sched_pick();
+	INIT_LIST_HEAD(&mypcm->sched_list);
+	INIT_LIST_HEAD(&mypcm->batch_list);
+	spin_lock_init(&mypcm->lock);
+	seqcount_init(&mypcm->snap_seq);
+
+	ss->runtime->private_data = mypcm;
+	ss->runtime->private_free = minivosc_runtime_free;
+	spin_lock_irq(&mypcm->cable->lock);
+	mypcm->cable->streams[ss->stream] = mypcm;
+	spin_unlock_irq(&mypcm->cable->lock);
 
 	mutex_unlock(&mydev->cable_lock);
 	return 0;
@@ -388,6 +1192,7 @@ static int minivosc_pcm_open(struct snd_pcm_substream *ss)
 static int minivosc_pcm_close(struct snd_pcm_substream *ss)
 {
 	struct minivosc_device *mydev = ss->private_data;
+	struct minivosc_pcm *mypcm = ss->runtime->private_data;
 
 	dbg("%s", __func__);
 
@@ -396,6 +1201,12 @@ static int minivosc_pcm_close(struct snd_pcm_substream *ss)
 	// * which will be set to null,
 	// * lock the mutex here anyway:
 	mutex_lock(&mydev->cable_lock);
+	// * make sure the timer callback is not running anymore;
+	// * mypcm itself is freed later, by minivosc_runtime_free:
+	minivosc_timer_sync(mypcm);
+	spin_lock_irq(&mypcm->cable->lock);
+	mypcm->cable->streams[ss->stream] = NULL;
+	spin_unlock_irq(&mypcm->cable->lock);
 	// * not much else to do here, but set to null:
 	ss->private_data = NULL;
 	mutex_unlock(&mydev->cable_lock);
@@ -408,54 +1219,84 @@ static int minivosc_pcm_prepare(struct snd_pcm_substream *ss)
 {
 	// copied from aloop-kernel.c
 
-	// for one, we could get mydev from ss->private_data...
-	// here we try it via ss->runtime->private_data instead.
-	// turns out, this type of call via runtime->private_data
-	// ends up with mydev as null pointer causing SIGSEGV
-	// .. UNLESS runtime->private_data is assigned in _open?
+	// mydev (the card) comes from ss->private_data, and
+	// the per substream state from ss->runtime->private_data,
+	// which is assigned in _open
 	struct snd_pcm_runtime *runtime = ss->runtime;
-	struct minivosc_device *mydev = runtime->private_data;
+	struct minivosc_device *mydev = ss->private_data;
+	struct minivosc_pcm *mypcm = runtime->private_data;
 	unsigned int bps;
+	int err;
 
 	dbg("%s", __func__);
 
+	// a stopped stream may still have its timer callback in flight
+	minivosc_timer_sync(mypcm);
+
 	bps = runtime->rate * runtime->channels; // params requested by user app (arecord, audacity)
 	bps *= snd_pcm_format_width(runtime->format);
 	bps /= 8;
 	if (bps <= 0)
 		return -EINVAL;
 
-	mydev->buf_pos = 0;
-	mydev->pcm_buffer_size = frames_to_bytes(runtime, runtime->buffer_size);
-	dbg2("	bps: %u; runtime->buffer_size: %lu; mydev->pcm_buffer_size: %u", bps, runtime->buffer_size, mydev->pcm_buffer_size);
+	// pick the store routine for this format/channel count,
+	// and prerender the signal if we can
 	if (ss->stream == SNDRV_PCM_STREAM_CAPTURE) {
-		/* clear capture buffer */
-		mydev->silent_size = mydev->pcm_buffer_size;
-		//memset(runtime->dma_area, 0, mydev->pcm_buffer_size);
-		// we're in char land here, so let's mark prepare buffer with value 45 (signature)
-		// this turns out to set everything permanently throughout - not just first buffer,
-		// even though it runs only at start?
-		memset(runtime->dma_area, 45, mydev->pcm_buffer_size);
+		mutex_lock(&mydev->cable_lock);
+		minivosc_loop_recheck(mypcm);
+		mutex_unlock(&mydev->cable_lock);
+		minivosc_params_load(mypcm);
+		mypcm->engine = minivosc_engine_for(runtime);
+		err = minivosc_fill_setup(mypcm, runtime);
+		if (err < 0)
+			return err;
+		minivosc_probe_setup(&mypcm->probe, mydev->probe_interval,
+		                     mydev->probe_channel, runtime->channels,
+		                     frames_to_bytes(runtime, 1), runtime->rate);
 	}
 
-	if (!mydev->running) {
-		mydev->irq_pos = 0;
-		mydev->period_update_pending = 0;
+	// the timer does not service us now, but the position state is
+	// under mypcm->lock all the same (the snapshot wants it anyway)
+	spin_lock_irq(&mypcm->lock);
+	mypcm->buf_pos = 0;
+	mypcm->head = 0;
+	mypcm->pcm_channels = runtime->channels;
+	mypcm->pcm_frame_bytes = frames_to_bytes(runtime, 1);
+	mypcm->pcm_buffer_size = frames_to_bytes(runtime, runtime->buffer_size);
+	if (!mypcm->running) {
+		mypcm->pos.irq_pos = 0;
+		mypcm->pos.frames = 0;
+		mypcm->period_update_pending = 0;
 	}
-
-
-	mutex_lock(&mydev->cable_lock);
-	if (!(mydev->valid & ~(1 << ss->stream))) {
-		mydev->pcm_bps = bps;
-		mydev->pcm_period_size =
+	if (!(mypcm->valid & ~(1 << ss->stream))) {
+		mypcm->pcm_period_size =
 			frames_to_bytes(runtime, runtime->period_size);
-		mydev->period_size_frac = frac_pos(mydev->pcm_period_size);
+		minivosc_pos_setup(&mypcm->pos, runtime->rate,
+		                   runtime->period_size, runtime->buffer_size);
 
 	}
-	mydev->valid |= 1 << ss->stream;
-	mutex_unlock(&mydev->cable_lock);
+	mypcm->valid |= 1 << ss->stream;
+	minivosc_snap_publish(mypcm);
+	spin_unlock_irq(&mypcm->lock);
+	dbg2("	bps: %u; runtime->buffer_size: %lu; mypcm->pcm_buffer_size: %u", bps, runtime->buffer_size, mypcm->pcm_buffer_size);
+	if (mypcm->lazy) {
+		// mmap: the whole first buffer is about to be read (the
+		// core resets hw_ptr and appl_ptr to 0, after us)
+		mypcm->lazy_done = 0;
+		if (runtime->access != SNDRV_PCM_ACCESS_RW_INTERLEAVED &&
+		    !mypcm->loop_shared)
+			minivosc_lazy_fill(mypcm, runtime->buffer_size);
+	} else if (ss->stream == SNDRV_PCM_STREAM_CAPTURE && !mypcm->loop_shared) {
+		/* clear capture buffer */
+		mypcm->silent_size = mypcm->pcm_buffer_size;
+		//memset(runtime->dma_area, 0, mypcm->pcm_buffer_size);
+		// we're in char land here, so let's mark prepare buffer with value 45 (signature)
+		// this turns out to set everything permanently throughout - not just first buffer,
+		// even though it runs only at start?
+		memset(runtime->dma_area, 45, mypcm->pcm_buffer_size);
+	}
 
-	dbg2("	pcm_period_size: %u; period_size_frac: %u", mydev->pcm_period_size, mydev->period_size_frac);
+	dbg2("	pcm_period_size: %u; period_size_frac: %llu", mypcm->pcm_period_size, (unsigned long long)mypcm->pos.period_size_frac);
 
 	return 0;
 }
@@ -465,33 +1306,65 @@ static int minivosc_pcm_trigger(struct snd_pcm_substream *ss,
                           int cmd)
 {
 	int ret = 0;
+	bool start = false, stop = false;
+	unsigned long flags;
 	//copied from aloop-kernel.c
 
-	//here we do not get mydev from
-	// ss->runtime->private_data; but from:
-	struct minivosc_device *mydev = ss->private_data;
+	//here we get the per substream state from
+	// ss->runtime->private_data (mydev is in ss->private_data):
+	struct minivosc_pcm *mypcm = ss->runtime->private_data;
 
 	dbg("%s - trig %d", __func__, cmd);
 
+	// the state changes under mypcm->lock; the timer is (dis)armed
+	// after dropping it, as its callback takes sched->lock first
 	switch (cmd)
 	{
 		case SNDRV_PCM_TRIGGER_START:
 			// Start the hardware capture
 			// from aloop-kernel.c:
-			if (!mydev->running) {
-				mydev->last_jiffies = jiffies;
-				// SET OFF THE TIMER HERE:
-				minivosc_timer_start(mydev);
+			// irqsave: the stream lock may be a mutex, for
+			// nonatomic PCMs, and the timer takes ours
+			spin_lock_irqsave(&mypcm->lock, flags);
+			if (!mypcm->running) {
+				// the timer of this CPU: prepare has synced
+				// with the one we had, so it may change now
+				mypcm->sched = minivosc_sched_pick();
+				mypcm->last_time = ktime_get();
+				mypcm->no_wakeup = ss->runtime->no_period_wakeup;
+				mypcm->nowake_span = 0;
+				// fill ahead right away, see minivosc_pos_update
+				mypcm->catchup = 1;
+				minivosc_snap_publish(mypcm);
+				// running before the timer is armed, else the
+				// shared callback would skip this substream
+				spin_lock(&mypcm->cable->lock);
+				mypcm->running |= (1 << ss->stream);
+				mypcm->looped = 0;
+				spin_unlock(&mypcm->cable->lock);
+				start = true;
 			}
-			mydev->running |= (1 << ss->stream);
+			spin_unlock_irqrestore(&mypcm->lock, flags);
+			// SET OFF THE TIMER HERE - also when the
+			// application does not want period wakeups:
+			// the timer is what fills the buffer
+			if (start)
+				minivosc_timer_start(mypcm);
 			break;
 		case SNDRV_PCM_TRIGGER_STOP:
 			// Stop the hardware capture
 			// from aloop-kernel.c:
-			mydev->running &= ~(1 << ss->stream);
-			if (!mydev->running)
+			// under cable->lock, so the peer is not looping
+			// from/into our buffer anymore after this
+			spin_lock_irqsave(&mypcm->lock, flags);
+			spin_lock(&mypcm->cable->lock);
+			mypcm->running &= ~(1 << ss->stream);
+			spin_unlock(&mypcm->cable->lock);
+			stop = !mypcm->running;
+			spin_unlock_irqrestore(&mypcm->lock, flags);
+			if (stop)
 				// STOP THE TIMER HERE:
-				minivosc_timer_stop(mydev);
+				minivosc_timer_stop(mypcm);
 			break;
 		default:
 			ret = -EINVAL;
@@ -501,18 +1374,50 @@ static int minivosc_pcm_trigger(struct snd_pcm_substream *ss,
 }
 
 
+// the position as of the last update by the timer, moved on by the
+// clock as far as the buffer is filled (see minivosc_snap_publish):
+// only the timer moves it for real (and generates), so this may come
+// from anywhere, as often as it likes, without taking a lock
 static snd_pcm_uframes_t minivosc_pcm_pointer(struct snd_pcm_substream *ss)
 {
-	//copied from aloop-kernel.c
 	struct snd_pcm_runtime *runtime = ss->runtime;
-	struct minivosc_device *mydev= runtime->private_data;
+	struct minivosc_pcm *mypcm = runtime->private_data;
+	struct minivosc_snap *ps = &mypcm->ptr_snap;
+	u64 link_ns, n = 0;
+	s64 delta;
+
+	minivosc_snap_read(mypcm, ps);
+	delta = ktime_to_ns(ktime_sub(ktime_get(), ps->time));
+	if (ps->ahead && delta > 0) {
+		link_ns = minivosc_frame_link_ns(ps->frames, runtime->rate);
+		n = minivosc_link_frames(link_ns + delta, runtime->rate) -
+			ps->frames;
+		n = min_t(u64, n, ps->ahead);
+		ps->frames += n;
+		ps->time = ktime_add_ns(ps->time,
+			minivosc_frame_link_ns(ps->frames, runtime->rate) -
+			link_ns);
+		ps->pos = (ps->pos + frames_to_bytes(runtime, n)) %
+			mypcm->pcm_buffer_size;
+	}
+	return bytes_to_frames(runtime, ps->pos);
+}
 
-	dbg2("+minivosc_pointer ");
-	minivosc_pos_update(mydev);
-	dbg2("+	bytes_to_frames(: %lu, mydev->buf_pos: %d", bytes_to_frames(runtime, mydev->buf_pos),mydev->buf_pos);
-	return bytes_to_frames(runtime, mydev->buf_pos);
+// called right after _pointer, in the same hw_ptr update, so it
+// reports the snapshot _pointer read: the position counts frames of
+// our own time base, so the audio time is exact - the time of the
+// frame reported since the start (see minivosc_frame_link_ns)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,8,0)
+static int minivosc_pcm_wall_clock(struct snd_pcm_substream *ss,
+                                   struct timespec *audio_ts)
+{
+	struct minivosc_pcm *mypcm = ss->runtime->private_data;
 
+	*audio_ts = ns_to_timespec(minivosc_frame_link_ns(mypcm->ptr_snap.frames,
+	                                                  ss->runtime->rate));
+	return 0;
 }
+#endif
 
 
 /*
@@ -520,214 +1425,1678 @@ static snd_pcm_uframes_t minivosc_pcm_pointer(struct snd_pcm_substream *ss)
  * Timer functions
  *
  */
-static void minivosc_timer_start(struct minivosc_device *mydev)
+// absolute time at which the current period ends (without wakeups,
+// nowake_span is over), as seen from the last position update - or
+// soon, if that left some filling to do
+static ktime_t minivosc_timer_expires(struct minivosc_pcm *mypcm)
 {
-	unsigned long tick;
-	dbg2("minivosc_timer_start: mydev->period_size_frac: %u; mydev->irq_pos: %u jiffies: %lu pcm_bps %u", mydev->period_size_frac, mydev->irq_pos, jiffies, mydev->pcm_bps);
-	tick = mydev->period_size_frac - mydev->irq_pos;
-	tick = (tick + mydev->pcm_bps - 1) / mydev->pcm_bps;
-	mydev->timer.expires = jiffies + tick;
-	add_timer(&mydev->timer);
+	struct minivosc_pos *pos = &mypcm->pos;
+	u64 ns;
+
+	if (mypcm->nowake_span)
+		ns = minivosc_frame_link_ns(pos->frames + mypcm->nowake_span,
+		                            pos->rate) -
+			minivosc_pos_link_ns(pos) -
+			minivosc_pos_frame_age_ns(pos);
+	else
+		ns = minivosc_pos_period_ns(pos);
+
+	if (mypcm->catchup)
+		ns = min_t(u64, ns, MINIVOSC_CATCHUP_NS);
+	return ktime_add_ns(mypcm->last_time, ns);
 }
 
-static void minivosc_timer_stop(struct minivosc_device *mydev)
+// (re)arm the shared timer for the earliest period end of its
+// substreams; called with sched->lock held, on sched->cpu
+static void minivosc_sched_arm(struct minivosc_sched *sched)
 {
-	dbg2("minivosc_timer_stop");
-	del_timer(&mydev->timer);
+	struct minivosc_pcm *mypcm;
+	ktime_t expires = ktime_set(KTIME_SEC_MAX, 0);
+	bool any = false;
+
+	// in the list means running: trigger adds and removes them
+	list_for_each_entry(mypcm, &sched->streams, sched_list) {
+		if (!any || ktime_compare(mypcm->expires, expires) < 0)
+			expires = mypcm->expires;
+		any = true;
+	}
+	if (any)
+		hrtimer_start(&sched->timer, expires, HRTIMER_MODE_ABS_PINNED);
 }
 
-static void minivosc_pos_update(struct minivosc_device *mydev)
+static void minivosc_timer_start(struct minivosc_pcm *mypcm)
 {
-	unsigned int last_pos, count;
-	unsigned long delta;
-
-	if (!mydev->running)
-		return;
+	struct minivosc_sched *sched = mypcm->sched;
+	unsigned long flags;
+
+	dbg2("minivosc_timer_start: mypcm->pos.period_size_frac: %llu; mypcm->pos.irq_pos: %llu rate %u", (unsigned long long)mypcm->pos.period_size_frac, (unsigned long long)mypcm->pos.irq_pos, mypcm->pos.rate);
+	spin_lock_irqsave(&sched->lock, flags);
+	mypcm->expires = minivosc_timer_expires(mypcm);
+	list_add_tail(&mypcm->sched_list, &sched->streams);
+	if (sched->thread && sched->cpu != smp_processor_id()) {
+		// the thread arms it, on its own CPU
+		ACCESS_ONCE(sched->kick) = 1;
+		wake_up_process(sched->thread);
+	} else {
+		minivosc_sched_arm(sched);
+	}
+	spin_unlock_irqrestore(&sched->lock, flags);
+}
 
-	dbg2("*minivosc_pos_update: running ");
+// called from trigger, in atomic context: the shared callback may be
+// running snd_pcm_period_elapsed() and spinning on the stream lock we hold,
+// so we must not wait for it here - see minivosc_timer_sync()
+static void minivosc_timer_stop(struct minivosc_pcm *mypcm)
+{
+	struct minivosc_sched *sched = mypcm->sched;
+	unsigned long flags;
 
-	delta = jiffies - mydev->last_jiffies;
-	dbg2("*	: jiffies %lu, ->last_jiffies %lu, delta %lu", jiffies, mydev->last_jiffies, delta);
+	dbg2("minivosc_timer_stop");
+	spin_lock_irqsave(&sched->lock, flags);
+	list_del_init(&mypcm->sched_list);
+	spin_unlock_irqrestore(&sched->lock, flags);
+}
 
-	if (!delta)
-		return;
+// waits until a (possibly running) timer callback is done with this
+// (stopped) substream; only from sleepable context. Not by cancelling:
+// the other substreams still need the timer, and re-arming it from
+// here would move it to our CPU. A callback that still had us started
+// before trigger took us off the list, and is short (see
+// MINIVOSC_FILL_BYTES)
+static void minivosc_timer_sync(struct minivosc_pcm *mypcm)
+{
+	struct minivosc_sched *sched = mypcm->sched;
+
+	while (hrtimer_callback_running(&sched->timer))
+		cpu_relax();
+	// and for the fill thread, if it is servicing
+	if (sched->thread) {
+		mutex_lock(&sched->run_lock);
+		mutex_unlock(&sched->run_lock);
+	}
+}
 
-	mydev->last_jiffies += delta;
+// whether the data of the substream goes to, or comes from, elsewhere
+// (its loop peer, or an injection ring) at the pace of the timer: then
+// the timer fills nothing ahead, and _pointer waits for it
+static bool minivosc_fed(struct minivosc_pcm *mypcm)
+{
+	bool ret;
 
-	last_pos = byte_pos(mydev->irq_pos);
-	mydev->irq_pos += delta * mydev->pcm_bps;
-	count = byte_pos(mydev->irq_pos) - last_pos;
-	dbg2("*	: last_pos %d, c->irq_pos %d, count %d", last_pos, mydev->irq_pos, count);
+	spin_lock(&mypcm->cable->lock);
+	ret = mypcm->looped || mypcm->loop_shared || mypcm->cable->ring;
+	spin_unlock(&mypcm->cable->lock);
+	return ret;
+}
 
-	if (!count)
-		return;
+// frames past the position the stream runs on without the timer: to
+// the end of the period, or without wakeups, to the next timer and
+// the margin past it
+static unsigned int minivosc_stream_lead(struct minivosc_pcm *mypcm)
+{
+	struct minivosc_pos *pos = &mypcm->pos;
+
+	if (!mypcm->nowake_span)
+		return minivosc_pos_period_left(pos);
+	return mypcm->nowake_span +
+		min_t(u64, minivosc_link_frames(MINIVOSC_NOWAKE_MARGIN_NS,
+		                                pos->rate),
+		      pos->buffer_frames / 4);
+}
+
+// makes the position visible to _pointer; called with mypcm->lock
+// held, which serializes the writers. Past the position, _pointer may
+// go on by the clock through what is filled - or as far as
+// minivosc_stream_lead, if we fill nothing (played, or lazy); behind
+// the clock, the position waits at what is filled, if the last update
+// left some to do
+static void minivosc_snap_publish(struct minivosc_pcm *mypcm)
+{
+	struct minivosc_pos *pos = &mypcm->pos;
+	s64 ahead = (s64)(mypcm->head - pos->frames);
+	unsigned int at = mypcm->buf_pos, free = 0;
+	u64 frames = pos->frames;
+	ktime_t time;
+
+	time = ktime_sub_ns(mypcm->last_time, minivosc_pos_frame_age_ns(pos));
+	if (ahead < 0) {
+		frames = mypcm->head;
+		time = ktime_sub_ns(time, minivosc_pos_link_ns(pos) -
+		                    minivosc_frame_link_ns(frames, pos->rate));
+	} else {
+		at = (at + mypcm->pcm_buffer_size -
+		      (unsigned int)ahead * mypcm->pcm_frame_bytes) %
+			mypcm->pcm_buffer_size;
+		if (!mypcm->running || minivosc_fed(mypcm))
+			free = 0;
+		else if (mypcm->running == CABLE_PLAYBACK || mypcm->lazy)
+			free = minivosc_stream_lead(mypcm);
+		else
+			free = ahead;
+	}
+	write_seqcount_begin(&mypcm->snap_seq);
+	mypcm->snap.pos = at;
+	mypcm->snap.frames = frames;
+	mypcm->snap.time = time;
+	mypcm->snap.ahead = free;
+	write_seqcount_end(&mypcm->snap_seq);
+}
+
+// a consistent copy of the last published position, without locks:
+// retried if the timer was publishing meanwhile
+static void minivosc_snap_read(struct minivosc_pcm *mypcm,
+                               struct minivosc_snap *snap)
+{
+	unsigned int seq;
 
+	do {
+		seq = read_seqcount_begin(&mypcm->snap_seq);
+		*snap = mypcm->snap;
+	} while (read_seqcount_retry(&mypcm->snap_seq, seq));
+}
+
+// brings the position up to the monotonic clock, filling the buffer
+// on the way - generated capture as far as minivosc_stream_lead, so
+// _pointer can move on through it by the clock; the arithmetic is in
+// minivosc_pos_advance. Only from the timer callback, the one context
+// that generates for the stream, with mypcm->lock held. At most
+// MINIVOSC_FILL_BYTES are filled: the rest is left for the next
+// callback. With defer, generated capture is not filled here: its
+// bytes are returned, for the caller to fill without the lock and
+// publish then (see minivosc_stream_service); 0 if none
+static unsigned int minivosc_pos_update(struct minivosc_pcm *mypcm, bool defer)
+{
+	struct minivosc_pos *pos = &mypcm->pos;
+	unsigned int elapsed, fill = 0, cap;
+	u64 count;
+	s64 ahead, want = 0;
+	bool behind, fed;
+	u32 skip;
+	ktime_t now;
+	s64 delta;
+
+	if (!mypcm->running)
+		return 0;
+
+	now = ktime_get();
+	delta = ktime_to_ns(ktime_sub(now, mypcm->last_time));
+
+	if (delta <= 0)
+		return 0;
+
+	mypcm->last_time = now;
+
+	behind = mypcm->head < pos->frames;
+	count = minivosc_pos_advance(pos, delta, &elapsed);
+	trace_minivosc_pos_update(mypcm->substream, delta, count);
+
+	// from the frames counted, as count is only right modulo the buffer
+	ahead = (s64)(mypcm->head - pos->frames);
+	if (ahead < -(s64)pos->buffer_frames) {
+		// older than a buffer, it would only be overwritten
+		div_u64_rem(-ahead - pos->buffer_frames, pos->buffer_frames,
+		            &skip);
+		mypcm->buf_pos = (mypcm->buf_pos +
+			skip * mypcm->pcm_frame_bytes) % mypcm->pcm_buffer_size;
+		mypcm->head = pos->frames - pos->buffer_frames;
+		ahead = -(s64)pos->buffer_frames;
+	}
+	// no wakeups: only the looped and injected data needs the timer
+	// at every period end
+	fed = minivosc_fed(mypcm);
+	mypcm->nowake_span = mypcm->no_wakeup && !fed ?
+		pos->buffer_frames / 2 : 0;
+	if (mypcm->running == CABLE_CAPTURE && !mypcm->lazy && !fed)
+		want = minivosc_stream_lead(mypcm);
+	cap = max(MINIVOSC_FILL_BYTES / mypcm->pcm_frame_bytes, 1U);
+	if (want > ahead)
+		fill = min_t(s64, want - ahead, cap);
+	mypcm->head += fill;
+	mypcm->catchup = ahead + fill < want;
+
+	if (elapsed & MINIVOSC_POS_CATCHUP)
+		this_cpu_inc(mypcm->stats->catchups);
+	// also once the position moves on, after a capped fill, without
+	// a period end: let the core see it
+	if (elapsed || (behind && fill))
+		mypcm->period_update_pending = 1;
+
+	if (defer && want && fill)
+		return fill * mypcm->pcm_frame_bytes;
 	// FILL BUFFER HERE
-	minivosc_xfer_buf(mydev, count);
+	if (fill)
+		minivosc_xfer_buf(mypcm, fill * mypcm->pcm_frame_bytes);
+	minivosc_snap_publish(mypcm);
+	return 0;
+}
 
-	if (mydev->irq_pos >= mydev->period_size_frac)
+// counts a wakeup, into the bucket of how late it came
+static void minivosc_stats_wakeup(struct minivosc_pcm *mypcm, ktime_t now)
+{
+	s64 late = ktime_us_delta(now, mypcm->expires);
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(minivosc_late_us); i++)
+		if (late < minivosc_late_us[i])
+			break;
+	this_cpu_inc(mypcm->stats->wakeups);
+	this_cpu_inc(mypcm->stats->late[i]);
+}
+
+// services a due substream, in the timer callback or the fill
+// thread (thread): returns true if it has a period elapsed to report,
+// and when it is due next in *expires
+static bool minivosc_stream_service(struct minivosc_pcm *mypcm, ktime_t now,
+                                    ktime_t *expires, bool thread)
+{
+	unsigned long flags;
+	unsigned int bytes;
+	bool elapsed = false;
+
+	// a trigger on another CPU may be stopping it meanwhile:
+	// then pos_update sees it not running, and does nothing.
+	// irqsave, as trigger takes the lock in interrupt context too
+	// (and the fill thread runs with interrupts on)
+	spin_lock_irqsave(&mypcm->lock, flags);
+	minivosc_stats_wakeup(mypcm, now);
+	bytes = minivosc_pos_update(mypcm, thread);
+	if (bytes) {
+		// the fill thread generates with interrupts on: what it
+		// claimed, past the published position, is no one else's
+		// (only we move the position, and prepare and hw_free wait
+		// for run_lock), and _pointer sees it once published
+		spin_unlock_irqrestore(&mypcm->lock, flags);
+		minivosc_xfer_buf(mypcm, bytes);
+		spin_lock_irqsave(&mypcm->lock, flags);
+		if (mypcm->running)
+			minivosc_snap_publish(mypcm);
+	}
+	if (mypcm->period_update_pending)
 	{
-		dbg2("*	: mydev->irq_pos >= mydev->period_size_frac %d", mydev->period_size_frac);
-		mydev->irq_pos %= mydev->period_size_frac;
-		mydev->period_update_pending = 1;
+		mypcm->period_update_pending = 0;
+		// no wakeups: the core picks the position up itself
+		elapsed = !mypcm->no_wakeup;
+	}
+	*expires = minivosc_timer_expires(mypcm);
+	spin_unlock_irqrestore(&mypcm->lock, flags);
+	return elapsed;
+}
+
+// without sched->lock: period_elapsed may stop the stream (xrun);
+// a substream is not freed before minivosc_timer_sync() saw us done
+static void minivosc_period_elapsed_batch(struct list_head *batch)
+{
+	struct minivosc_pcm *mypcm, *next;
+
+	list_for_each_entry_safe(mypcm, next, batch, batch_list)
+	{
+		trace_minivosc_period_elapsed(mypcm->substream);
+		this_cpu_inc(mypcm->stats->periods);
+		snd_pcm_period_elapsed(mypcm->substream);
+	}
+}
+
+static enum hrtimer_restart minivosc_timer_function(struct hrtimer *timer)
+{
+	struct minivosc_sched *sched =
+		container_of(timer, struct minivosc_sched, timer);
+	struct minivosc_pcm *mypcm;
+	LIST_HEAD(batch);
+	ktime_t now;
+	unsigned int due = 0, nbatch = 0;
+
+	// the fill thread does the rest, and re-arms the timer
+	if (sched->thread) {
+		ACCESS_ONCE(sched->kick) = 1;
+		wake_up_process(sched->thread);
+		return HRTIMER_NORESTART;
+	}
+
+	spin_lock(&sched->lock);
+	now = ktime_get();
+	list_for_each_entry(mypcm, &sched->streams, sched_list) {
+		if (ktime_compare(now, mypcm->expires) < 0)
+			continue;
+
+		due++;
+		if (minivosc_stream_service(mypcm, now, &mypcm->expires,
+		                            false)) {
+			list_add_tail(&mypcm->batch_list, &batch);
+			nbatch++;
+		}
+	}
+	// SET OFF THE TIMER HERE (exactly at the end of the next period):
+	minivosc_sched_arm(sched);
+	spin_unlock(&sched->lock);
+	trace_minivosc_timer(smp_processor_id(), due, nbatch);
+
+	minivosc_period_elapsed_batch(&batch);
+
+	// the timer was re-armed above, if still needed
+	return HRTIMER_NORESTART;
+}
+
+// what the timer callback does, in the fill thread: sched->lock only
+// to pick the due substreams and to re-arm, so the timer callbacks
+// (and the substreams of other CPUs) are not held up meanwhile
+static void minivosc_sched_run(struct minivosc_sched *sched)
+{
+	struct minivosc_pcm *mypcm, *next;
+	LIST_HEAD(serviced);
+	LIST_HEAD(batch);
+	ktime_t now;
+	unsigned int due = 0, nbatch = 0;
+
+	mutex_lock(&sched->run_lock);
+	spin_lock_irq(&sched->lock);
+	now = ktime_get();
+	list_for_each_entry(mypcm, &sched->streams, sched_list)
+		if (ktime_compare(now, mypcm->expires) >= 0)
+			list_add_tail(&mypcm->batch_list, &serviced);
+	spin_unlock_irq(&sched->lock);
+
+	// the next expiry comes from under mypcm->lock, as the position
+	// it follows; it goes to expires under sched->lock below (a
+	// substream stopped meanwhile is not started again before
+	// run_lock is free, see minivosc_timer_sync)
+	list_for_each_entry_safe(mypcm, next, &serviced, batch_list) {
+		due++;
+		if (minivosc_stream_service(mypcm, now, &mypcm->next_expires,
+		                            true)) {
+			list_move_tail(&mypcm->batch_list, &batch);
+			nbatch++;
+		}
+	}
+
+	spin_lock_irq(&sched->lock);
+	list_for_each_entry(mypcm, &serviced, batch_list)
+		mypcm->expires = mypcm->next_expires;
+	list_for_each_entry(mypcm, &batch, batch_list)
+		mypcm->expires = mypcm->next_expires;
+	minivosc_sched_arm(sched);
+	spin_unlock_irq(&sched->lock);
+	trace_minivosc_timer(raw_smp_processor_id(), due, nbatch);
+
+	minivosc_period_elapsed_batch(&batch);
+	mutex_unlock(&sched->run_lock);
+}
+
+static int minivosc_sched_thread(void *data)
+{
+	struct minivosc_sched *sched = data;
+
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop())
+			break;
+		if (!xchg(&sched->kick, 0)) {
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+		minivosc_sched_run(sched);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+// the scheduler for a substream being started: that of our CPU, but
+// with fill threads, the next CPU that has one (round robin) if ours
+// has none
+static struct minivosc_sched *minivosc_sched_pick(void)
+{
+	static atomic_t next = ATOMIC_INIT(0);
+	int cpu = raw_smp_processor_id();
+	unsigned int n;
+
+	if (fill_thread && !cpumask_test_cpu(cpu, minivosc_fill_mask)) {
+		n = (unsigned int)atomic_inc_return(&next) %
+			cpumask_weight(minivosc_fill_mask);
+		for_each_cpu(cpu, minivosc_fill_mask)
+			if (!n--)
+				break;
+	}
+	return per_cpu_ptr(&minivosc_sched, cpu);
+}
+
+static void minivosc_sched_exit(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		hrtimer_cancel(&per_cpu_ptr(&minivosc_sched, cpu)->timer);
+	// no substreams left, so nothing re-arms the timers now
+	for_each_possible_cpu(cpu) {
+		struct minivosc_sched *sched = per_cpu_ptr(&minivosc_sched, cpu);
+
+		if (sched->thread)
+			kthread_stop(sched->thread);
+		sched->thread = NULL;
+	}
+	free_cpumask_var(minivosc_fill_mask);
+}
+
+static int minivosc_sched_init(void)
+{
+	struct sched_param param;
+	struct task_struct *t;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct minivosc_sched *sched = per_cpu_ptr(&minivosc_sched, cpu);
+
+		spin_lock_init(&sched->lock);
+		INIT_LIST_HEAD(&sched->streams);
+		hrtimer_init(&sched->timer, CLOCK_MONOTONIC,
+		             HRTIMER_MODE_ABS_PINNED);
+		sched->timer.function = minivosc_timer_function;
+		mutex_init(&sched->run_lock);
+		sched->cpu = cpu;
+	}
+	if (!fill_thread)
+		return 0;
+
+	// the fill threads: on the online CPUs of fill_cpus (a CPU going
+	// offline later leaves its thread unbound, still serving)
+	if (!zalloc_cpumask_var(&minivosc_fill_mask, GFP_KERNEL))
+		return -ENOMEM;
+	if (fill_cpus && *fill_cpus) {
+		if (cpulist_parse(fill_cpus, minivosc_fill_mask) < 0) {
+			printk(KERN_ERR "minivosc: bad fill_cpus %s\n", fill_cpus);
+			goto __inval;
+		}
+		cpumask_and(minivosc_fill_mask, minivosc_fill_mask,
+		            cpu_online_mask);
+	} else {
+		cpumask_copy(minivosc_fill_mask, cpu_online_mask);
+	}
+	if (cpumask_empty(minivosc_fill_mask)) {
+		printk(KERN_ERR "minivosc: no online CPU in fill_cpus %s\n",
+		       fill_cpus);
+		goto __inval;
+	}
+
+	param.sched_priority = clamp(fill_prio, 0, MAX_RT_PRIO - 1);
+	for_each_cpu(cpu, minivosc_fill_mask) {
+		struct minivosc_sched *sched = per_cpu_ptr(&minivosc_sched, cpu);
+
+		t = kthread_create_on_node(minivosc_sched_thread, sched,
+		                           cpu_to_node(cpu), "minivosc/%d", cpu);
+		if (IS_ERR(t)) {
+			minivosc_sched_exit();
+			return PTR_ERR(t);
+		}
+		kthread_bind(t, cpu);
+		if (param.sched_priority)
+			sched_setscheduler_nocheck(t, SCHED_FIFO, &param);
+		sched->thread = t;
+		wake_up_process(t);
+	}
+	printk(KERN_INFO "minivosc: %u fill threads\n",
+	       cpumask_weight(minivosc_fill_mask));
+	return 0;
+
+__inval:
+	free_cpumask_var(minivosc_fill_mask);
+	return -EINVAL;
+}
+
+/*
+ *
+ * Statistics - /proc/asound/cardX/minivosc
+ *
+ */
+static void minivosc_proc_stream(struct snd_info_buffer *buffer,
+                                 struct minivosc_pcm *mypcm, int num)
+{
+	struct minivosc_stats sum;
+	unsigned int i;
+	int cpu;
+
+	memset(&sum, 0, sizeof(sum));
+	for_each_possible_cpu(cpu) {
+		struct minivosc_stats *st = per_cpu_ptr(mypcm->stats, cpu);
+
+		sum.wakeups += st->wakeups;
+		for (i = 0; i < MINIVOSC_LATE_BUCKETS; i++)
+			sum.late[i] += st->late[i];
+		sum.bytes += st->bytes;
+		sum.periods += st->periods;
+		sum.catchups += st->catchups;
+		sum.fills += st->fills;
+		sum.fill_cycles += st->fill_cycles;
+	}
+
+	snd_iprintf(buffer, "%s %d: %s%s, rate %u, %u ch, %u bytes/frame\n",
+	            mypcm->substream->stream == SNDRV_PCM_STREAM_PLAYBACK ?
+	            "playback" : "capture", num,
+	            mypcm->running ? "running" : "stopped",
+	            mypcm->looped ? " (looped)" : "",
+	            mypcm->pos.rate, mypcm->pcm_channels, mypcm->pcm_frame_bytes);
+	snd_iprintf(buffer, "  wakeups %llu periods %llu catchups %llu\n",
+	            (unsigned long long)sum.wakeups,
+	            (unsigned long long)sum.periods,
+	            (unsigned long long)sum.catchups);
+	snd_iprintf(buffer, "  late us:");
+	for (i = 0; i < ARRAY_SIZE(minivosc_late_us); i++)
+		snd_iprintf(buffer, " <%u:%llu", minivosc_late_us[i],
+		            (unsigned long long)sum.late[i]);
+	snd_iprintf(buffer, " >=%u:%llu\n", minivosc_late_us[i - 1],
+	            (unsigned long long)sum.late[i]);
+	snd_iprintf(buffer, "  bytes %llu fills %llu cycles/fill %llu\n",
+	            (unsigned long long)sum.bytes,
+	            (unsigned long long)sum.fills,
+	            sum.fills ? (unsigned long long)div64_u64(sum.fill_cycles, sum.fills) : 0ULL);
+}
+
+static void minivosc_proc_read(struct snd_info_entry *entry,
+                               struct snd_info_buffer *buffer)
+{
+	struct minivosc_device *mydev = entry->private_data;
+	struct minivosc_pcm_device *pcmdev;
+	struct minivosc_cable *cable;
+	struct minivosc_ring *ring;
+	struct minivosc_image *img;
+	unsigned int images = 0, users = 0, d;
+	size_t bytes = 0;
+	int i, dir;
+
+	// the substreams (and rings) cannot go away while we hold cable_lock
+	mutex_lock(&mydev->cable_lock);
+	for (d = 0; d < mydev->nr_devs; d++) {
+		pcmdev = &mydev->devs[d];
+		snd_iprintf(buffer, "pcm %u: %s\n", d, pcmdev->profile->name);
+		for (i = 0; i < MAX_PCM_SUBSTREAMS; i++) {
+			cable = &pcmdev->cables[i];
+			for (dir = 0; dir < 2; dir++)
+				if (cable->streams[dir])
+					minivosc_proc_stream(buffer, cable->streams[dir], i);
+			ring = cable->ring;
+			if (ring)
+				snd_iprintf(buffer, "inject %d: ring %u bytes, queued %u, underruns %u\n",
+				            i, ring->inj.mask + 1,
+				            ring->inj.ctl->head - ring->inj.ctl->tail,
+				            ring->inj.ctl->underruns);
+		}
+	}
+	mutex_unlock(&mydev->cable_lock);
+
+	// of all cards
+	mutex_lock(&minivosc_images_lock);
+	list_for_each_entry(img, &minivosc_images, list) {
+		images++;
+		users += img->users;
+		bytes += img->bytes;
+	}
+	mutex_unlock(&minivosc_images_lock);
+	snd_iprintf(buffer, "images: %u, %zu bytes, %u users\n",
+	            images, bytes, users);
+}
+
+// not fatal, if the entry cannot be created
+static void minivosc_proc_init(struct minivosc_device *mydev)
+{
+	struct snd_info_entry *entry;
+
+	if (!snd_card_proc_new(mydev->card, "minivosc", &entry))
+		snd_info_set_text_ops(entry, mydev, minivosc_proc_read);
+}
+
+/*
+ *
+ * Mixer controls
+ *
+ */
+// the current parameters into sig, before it is set up (prepare)
+static void minivosc_params_load(struct minivosc_pcm *mypcm)
+{
+	struct minivosc_signal *sig = &mypcm->sig;
+	const struct minivosc_params *p;
+	unsigned int i;
+
+	rcu_read_lock();
+	p = rcu_dereference(mypcm->pcmdev->params);
+	mypcm->params_seq = p->seq;
+	sig->osc_wave = p->wave;
+	sig->osc_freq = p->freq;
+	sig->osc_amp = p->amp;
+	sig->osc_lift = p->lift;
+	sig->osc_mute = p->mute;
+	// all channels alike (the default): one oscillator for all
+	sig->osc_voices = 0;
+	for (i = 0; i < MAX_CHANNELS; i++) {
+		sig->ch_freq[i] = p->chan[MINIVOSC_CHAN_FREQ][i];
+		sig->ch_amp[i] = p->chan[MINIVOSC_CHAN_AMP][i];
+		sig->ch_phase[i] = p->chan[MINIVOSC_CHAN_PHASE][i];
+		if (sig->ch_freq[i] || sig->ch_amp[i] != 100 || sig->ch_phase[i])
+			sig->osc_voices = 1;
 	}
+	rcu_read_unlock();
 }
 
-static void minivosc_timer_function(unsigned long data)
+// called before generating, from the timer (or copy/ack, in lazy mode):
+// picks up changed parameters without taking any lock. The image is of
+// the old signal, so from then on the oscillator runs live, on from
+// the same phase, until the next prepare renders a new image.
+static void minivosc_params_apply(struct minivosc_pcm *mypcm)
 {
-	struct minivosc_device *mydev = (struct minivosc_device *)data;
+	unsigned int seq;
 
-	if (!mydev->running)
+	rcu_read_lock();
+	seq = rcu_dereference(mypcm->pcmdev->params)->seq;
+	rcu_read_unlock();
+	if (likely(seq == mypcm->params_seq))
 		return;
+	minivosc_signal_live(&mypcm->sig);
+	minivosc_params_load(mypcm);
+	minivosc_signal_tune(&mypcm->sig);
+}
 
-	dbg2("minivosc_timer_function: running ");
-	minivosc_pos_update(mydev);
-	// SET OFF THE TIMER HERE:
-	minivosc_timer_start(mydev);
+enum {
+	MINIVOSC_CTL_WAVE,
+	MINIVOSC_CTL_FREQ,
+	MINIVOSC_CTL_AMP,
+	MINIVOSC_CTL_LIFT,
+	MINIVOSC_CTL_SWITCH,
+};
 
-	if (mydev->period_update_pending)
-	{
-		mydev->period_update_pending = 0;
+static int minivosc_ctl_info(struct snd_kcontrol *kcontrol,
+                             struct snd_ctl_elem_info *uinfo)
+{
+	static const char *const waves[] = {
+		"Table", "Sine", "Square", "Saw", "Triangle"
+	};
+
+	switch (kcontrol->private_value) {
+	case MINIVOSC_CTL_WAVE:
+		return snd_ctl_enum_info(uinfo, 1, ARRAY_SIZE(waves), waves);
+	case MINIVOSC_CTL_SWITCH:
+		return snd_ctl_boolean_mono_info(kcontrol, uinfo);
+	}
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	switch (kcontrol->private_value) {
+	case MINIVOSC_CTL_FREQ:
+		uinfo->value.integer.min = 1;
+		uinfo->value.integer.max = MINIVOSC_MAX_FREQ;
+		break;
+	case MINIVOSC_CTL_AMP:
+		uinfo->value.integer.min = 0;
+		uinfo->value.integer.max = 100;
+		break;
+	case MINIVOSC_CTL_LIFT:
+		uinfo->value.integer.min = -100;
+		uinfo->value.integer.max = 100;
+		break;
+	}
+	return 0;
+}
 
-		if (mydev->running)
-		{
-			dbg2("	: calling snd_pcm_period_elapsed");
-			snd_pcm_period_elapsed(mydev->substream);
+static int minivosc_ctl_get(struct snd_kcontrol *kcontrol,
+                            struct snd_ctl_elem_value *ucontrol)
+{
+	struct minivosc_pcm_device *pcmdev = snd_kcontrol_chip(kcontrol);
+	const struct minivosc_params *p;
+
+	rcu_read_lock();
+	p = rcu_dereference(pcmdev->params);
+	switch (kcontrol->private_value) {
+	case MINIVOSC_CTL_WAVE:
+		ucontrol->value.enumerated.item[0] = p->wave;
+		break;
+	case MINIVOSC_CTL_FREQ:
+		ucontrol->value.integer.value[0] = p->freq;
+		break;
+	case MINIVOSC_CTL_AMP:
+		ucontrol->value.integer.value[0] = p->amp;
+		break;
+	case MINIVOSC_CTL_LIFT:
+		ucontrol->value.integer.value[0] = p->lift;
+		break;
+	case MINIVOSC_CTL_SWITCH:
+		ucontrol->value.integer.value[0] = !p->mute;
+		break;
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+// a copy of the parameter block to change, with params_lock held;
+// NULL if out of memory
+static struct minivosc_params *minivosc_params_edit(struct minivosc_pcm_device *pcmdev)
+{
+	struct mutex *lock = &pcmdev->mydev->params_lock;
+	struct minivosc_params *p;
+
+	mutex_lock(lock);
+	p = kmemdup(rcu_dereference_protected(pcmdev->params,
+	                                      lockdep_is_held(lock)),
+	            sizeof(*p), GFP_KERNEL);
+	if (!p)
+		mutex_unlock(lock);
+	return p;
+}
+
+// publishes the edited block p, if changed; the streams pick it up
+// on their next fill. Returns the put callback result.
+static int minivosc_params_commit(struct minivosc_pcm_device *pcmdev,
+                                  struct minivosc_params *p, bool changed)
+{
+	struct mutex *lock = &pcmdev->mydev->params_lock;
+	struct minivosc_params *old;
+
+	if (!changed) {
+		mutex_unlock(lock);
+		kfree(p);
+		return 0;
+	}
+	old = rcu_dereference_protected(pcmdev->params, lockdep_is_held(lock));
+	p->seq++;
+	rcu_assign_pointer(pcmdev->params, p);
+	mutex_unlock(lock);
+	kfree_rcu(old, rcu);
+	return 1;
+}
+
+static int minivosc_ctl_put(struct snd_kcontrol *kcontrol,
+                            struct snd_ctl_elem_value *ucontrol)
+{
+	struct minivosc_pcm_device *pcmdev = snd_kcontrol_chip(kcontrol);
+	struct minivosc_params *p;
+	long val = ucontrol->value.integer.value[0];
+	bool changed;
+
+	switch (kcontrol->private_value) {
+	case MINIVOSC_CTL_WAVE:
+		val = ucontrol->value.enumerated.item[0];
+		if (val > MINIVOSC_WAVE_TRIANGLE)
+			return -EINVAL;
+		break;
+	case MINIVOSC_CTL_FREQ:
+		if (val < 1 || val > MINIVOSC_MAX_FREQ)
+			return -EINVAL;
+		break;
+	case MINIVOSC_CTL_AMP:
+		if (val < 0 || val > 100)
+			return -EINVAL;
+		break;
+	case MINIVOSC_CTL_LIFT:
+		if (val < -100 || val > 100)
+			return -EINVAL;
+		break;
+	case MINIVOSC_CTL_SWITCH:
+		val = !val; // mute
+		break;
+	}
+
+	p = minivosc_params_edit(pcmdev);
+	if (!p)
+		return -ENOMEM;
+	switch (kcontrol->private_value) {
+	case MINIVOSC_CTL_WAVE:
+		changed = p->wave != val;
+		p->wave = val;
+		break;
+	case MINIVOSC_CTL_FREQ:
+		changed = p->freq != val;
+		p->freq = val;
+		break;
+	case MINIVOSC_CTL_AMP:
+		changed = p->amp != val;
+		p->amp = val;
+		break;
+	case MINIVOSC_CTL_LIFT:
+		changed = p->lift != val;
+		p->lift = val;
+		break;
+	default:
+		changed = p->mute != val;
+		p->mute = val;
+		break;
+	}
+	return minivosc_params_commit(pcmdev, p, changed);
+}
+
+// per channel controls: one value for each channel (of all streams of the device),
+// private_value is MINIVOSC_CHAN_*
+static long minivosc_chan_ctl_max(unsigned long chan)
+{
+	switch (chan) {
+	case MINIVOSC_CHAN_FREQ:
+		return MINIVOSC_MAX_FREQ;
+	case MINIVOSC_CHAN_AMP:
+		return 100;
+	}
+	return 359;
+}
+
+static int minivosc_chan_ctl_info(struct snd_kcontrol *kcontrol,
+                                  struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = MAX_CHANNELS;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = minivosc_chan_ctl_max(kcontrol->private_value);
+	return 0;
+}
+
+static int minivosc_chan_ctl_get(struct snd_kcontrol *kcontrol,
+                                 struct snd_ctl_elem_value *ucontrol)
+{
+	struct minivosc_pcm_device *pcmdev = snd_kcontrol_chip(kcontrol);
+	const struct minivosc_params *p;
+	unsigned int i;
+
+	rcu_read_lock();
+	p = rcu_dereference(pcmdev->params);
+	for (i = 0; i < MAX_CHANNELS; i++)
+		ucontrol->value.integer.value[i] =
+			p->chan[kcontrol->private_value][i];
+	rcu_read_unlock();
+	return 0;
+}
+
+static int minivosc_chan_ctl_put(struct snd_kcontrol *kcontrol,
+                                 struct snd_ctl_elem_value *ucontrol)
+{
+	struct minivosc_pcm_device *pcmdev = snd_kcontrol_chip(kcontrol);
+	unsigned int *vals;
+	struct minivosc_params *p;
+	long max = minivosc_chan_ctl_max(kcontrol->private_value);
+	bool changed = false;
+	unsigned int i;
+
+	for (i = 0; i < MAX_CHANNELS; i++)
+		if (ucontrol->value.integer.value[i] < 0 ||
+		    ucontrol->value.integer.value[i] > max)
+			return -EINVAL;
+
+	p = minivosc_params_edit(pcmdev);
+	if (!p)
+		return -ENOMEM;
+	vals = p->chan[kcontrol->private_value];
+	for (i = 0; i < MAX_CHANNELS; i++) {
+		changed |= vals[i] != ucontrol->value.integer.value[i];
+		vals[i] = ucontrol->value.integer.value[i];
+	}
+	return minivosc_params_commit(pcmdev, p, changed);
+}
+
+#define MINIVOSC_CTL(xname, xctl) \
+{	.iface = SNDRV_CTL_ELEM_IFACE_MIXER, .name = xname, \
+	.info = minivosc_ctl_info, .get = minivosc_ctl_get, \
+	.put = minivosc_ctl_put, .private_value = xctl }
+
+#define MINIVOSC_CHAN_CTL(xname, xchan) \
+{	.iface = SNDRV_CTL_ELEM_IFACE_MIXER, .name = xname, \
+	.info = minivosc_chan_ctl_info, .get = minivosc_chan_ctl_get, \
+	.put = minivosc_chan_ctl_put, .private_value = xchan }
+
+static struct snd_kcontrol_new minivosc_ctls[] =
+{
+	MINIVOSC_CTL("Oscillator Waveform", MINIVOSC_CTL_WAVE),
+	MINIVOSC_CTL("Oscillator Frequency", MINIVOSC_CTL_FREQ),
+	MINIVOSC_CTL("Oscillator Capture Volume", MINIVOSC_CTL_AMP),
+	MINIVOSC_CTL("Oscillator DC Offset", MINIVOSC_CTL_LIFT),
+	MINIVOSC_CTL("Oscillator Capture Switch", MINIVOSC_CTL_SWITCH),
+	MINIVOSC_CHAN_CTL("Oscillator Channel Frequency", MINIVOSC_CHAN_FREQ),
+	MINIVOSC_CHAN_CTL("Oscillator Channel Capture Volume", MINIVOSC_CHAN_AMP),
+	MINIVOSC_CHAN_CTL("Oscillator Channel Phase", MINIVOSC_CHAN_PHASE),
+};
+
+// the controls of PCM device N have index N
+static int minivosc_mixer_new(struct minivosc_pcm_device *pcmdev)
+{
+	struct snd_card *card = pcmdev->mydev->card;
+	struct snd_kcontrol *kctl;
+	unsigned int i;
+	int err;
+
+	strcpy(card->mixername, "minivosc oscillator");
+	for (i = 0; i < ARRAY_SIZE(minivosc_ctls); i++) {
+		kctl = snd_ctl_new1(&minivosc_ctls[i], pcmdev);
+		if (!kctl)
+			return -ENOMEM;
+		kctl->id.index = pcmdev->index;
+		err = snd_ctl_add(card, kctl);
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
+/*
+ *
+ * Injection ring (hwdep device)
+ *
+ */
+static void minivosc_ring_release(struct kref *ref)
+{
+	struct minivosc_ring *ring = container_of(ref, struct minivosc_ring, ref);
+
+	vfree(ring->area);
+	kfree(ring);
+}
+
+static void minivosc_ring_vm_open(struct vm_area_struct *vma)
+{
+	struct minivosc_ring *ring = vma->vm_private_data;
+
+	kref_get(&ring->ref);
+}
+
+static void minivosc_ring_vm_close(struct vm_area_struct *vma)
+{
+	struct minivosc_ring *ring = vma->vm_private_data;
+
+	kref_put(&ring->ref, minivosc_ring_release);
+}
+
+static const struct vm_operations_struct minivosc_ring_vm_ops = {
+	.open = minivosc_ring_vm_open,
+	.close = minivosc_ring_vm_close,
+};
+
+static int minivosc_ring_attach(struct minivosc_pcm_device *pcmdev,
+                                struct file *file,
+                                struct minivosc_inject_setup *setup)
+{
+	struct minivosc_device *mydev = pcmdev->mydev;
+	struct minivosc_cable *cable;
+	struct minivosc_ring *ring;
+	u32 bytes;
+	int err = 0;
+
+	if (setup->subdevice >= pcmdev->pcm->streams[SNDRV_PCM_STREAM_CAPTURE].substream_count ||
+	    setup->underrun > MINIVOSC_INJECT_UNDERRUN_OSC)
+		return -EINVAL;
+	bytes = roundup_pow_of_two(clamp_t(u32, setup->bytes,
+		MINIVOSC_INJECT_MIN_BYTES, MINIVOSC_INJECT_MAX_BYTES));
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+	ring->bytes = PAGE_SIZE + bytes;
+	ring->area = vmalloc_user(ring->bytes);
+	if (!ring->area) {
+		kfree(ring);
+		return -ENOMEM;
+	}
+	kref_init(&ring->ref);
+	ring->owner = file;
+	minivosc_inject_init(&ring->inj, (struct minivosc_inject_ctl *)ring->area,
+	                     ring->area + PAGE_SIZE, bytes, setup->underrun);
+	ring->inj.ctl->data_offset = PAGE_SIZE;
+
+	mutex_lock(&mydev->cable_lock);
+	cable = &pcmdev->cables[setup->subdevice];
+	if (cable->ring) {
+		err = -EBUSY;
+	} else {
+		spin_lock_irq(&cable->lock);
+		cable->ring = ring;
+		spin_unlock_irq(&cable->lock);
+	}
+	mutex_unlock(&mydev->cable_lock);
+	if (err < 0) {
+		kref_put(&ring->ref, minivosc_ring_release);
+		return err;
+	}
+
+	setup->bytes = bytes;
+	setup->offset = setup->subdevice * MINIVOSC_INJECT_STRIDE;
+	dbg("%s: capture %u,%u fed from a %u byte ring", __func__,
+	    pcmdev->index, setup->subdevice, bytes);
+	return 0;
+}
+
+// detaches the ring(s) set up through file: of subdevice, or all of
+// them if subdevice < 0. The capture goes back to the oscillator.
+static int minivosc_ring_detach(struct minivosc_pcm_device *pcmdev,
+                                struct file *file, int subdevice)
+{
+	struct minivosc_device *mydev = pcmdev->mydev;
+	struct minivosc_cable *cable;
+	struct minivosc_ring *ring;
+	int i, err = -ENXIO;
+
+	mutex_lock(&mydev->cable_lock);
+	for (i = 0; i < MAX_PCM_SUBSTREAMS; i++) {
+		cable = &pcmdev->cables[i];
+		ring = cable->ring;
+		if (!ring || ring->owner != file ||
+		    (subdevice >= 0 && i != subdevice))
+			continue;
+		// the fill path only uses the ring under cable->lock
+		spin_lock_irq(&cable->lock);
+		cable->ring = NULL;
+		spin_unlock_irq(&cable->lock);
+		kref_put(&ring->ref, minivosc_ring_release);
+		err = 0;
+	}
+	mutex_unlock(&mydev->cable_lock);
+	return err;
+}
+
+static int minivosc_inject_release(struct snd_hwdep *hw, struct file *file)
+{
+	minivosc_ring_detach(hw->private_data, file, -1);
+	return 0;
+}
+
+static int minivosc_inject_ioctl(struct snd_hwdep *hw, struct file *file,
+                                 unsigned int cmd, unsigned long arg)
+{
+	struct minivosc_inject_setup setup;
+	void __user *argp = (void __user *)arg;
+	u32 subdevice;
+	int err;
+
+	switch (cmd) {
+	case MINIVOSC_IOCTL_INJECT_SETUP:
+		if (copy_from_user(&setup, argp, sizeof(setup)))
+			return -EFAULT;
+		err = minivosc_ring_attach(hw->private_data, file, &setup);
+		if (err < 0)
+			return err;
+		if (copy_to_user(argp, &setup, sizeof(setup))) {
+			minivosc_ring_detach(hw->private_data, file,
+			                     setup.subdevice);
+			return -EFAULT;
 		}
+		return 0;
+	case MINIVOSC_IOCTL_INJECT_DETACH:
+		if (get_user(subdevice, (u32 __user *)argp))
+			return -EFAULT;
+		if (subdevice >= MAX_PCM_SUBSTREAMS)
+			return -EINVAL;
+		return minivosc_ring_detach(hw->private_data, file, subdevice);
 	}
+	return -ENOTTY;
 }
 
-#define CABLE_PLAYBACK	(1 << SNDRV_PCM_STREAM_PLAYBACK)
-#define CABLE_CAPTURE	(1 << SNDRV_PCM_STREAM_CAPTURE)
-#define CABLE_BOTH	(CABLE_PLAYBACK | CABLE_CAPTURE)
+// the ring of subdevice n is at n * MINIVOSC_INJECT_STRIDE; only the
+// file that set it up may map it
+static int minivosc_inject_mmap(struct snd_hwdep *hw, struct file *file,
+                                struct vm_area_struct *vma)
+{
+	struct minivosc_pcm_device *pcmdev = hw->private_data;
+	struct minivosc_device *mydev = pcmdev->mydev;
+	unsigned long stride = MINIVOSC_INJECT_STRIDE >> PAGE_SHIFT;
+	unsigned long subdevice = vma->vm_pgoff / stride;
+	struct minivosc_ring *ring;
+	int err;
+
+	if (vma->vm_pgoff % stride || subdevice >= MAX_PCM_SUBSTREAMS)
+		return -EINVAL;
+
+	mutex_lock(&mydev->cable_lock);
+	ring = pcmdev->cables[subdevice].ring;
+	if (!ring || ring->owner != file) {
+		err = -ENXIO;
+	} else {
+		err = remap_vmalloc_range(vma, ring->area, 0);
+		if (!err) {
+			vma->vm_private_data = ring;
+			vma->vm_ops = &minivosc_ring_vm_ops;
+			minivosc_ring_vm_open(vma);
+		}
+	}
+	mutex_unlock(&mydev->cable_lock);
+	return err;
+}
+
+// the hwdep device of PCM device N: /dev/snd/hwC<card>DN
+static int minivosc_inject_new(struct minivosc_pcm_device *pcmdev)
+{
+	struct snd_hwdep *hw;
+	int err;
+
+	err = snd_hwdep_new(pcmdev->mydev->card, "minivosc inject",
+	                    pcmdev->index, &hw);
+	if (err < 0)
+		return err;
+	sprintf(hw->name, "minivosc injection ring %u", pcmdev->index);
+	hw->private_data = pcmdev;
+	hw->ops.release = minivosc_inject_release;
+	hw->ops.ioctl = minivosc_inject_ioctl;
+	hw->ops.ioctl_compat = minivosc_inject_ioctl; // no pointers inside
+	hw->ops.mmap = minivosc_inject_mmap;
+	return 0;
+}
+
+/*
+ *
+ * Generator (fill) functions
+ *
+ */
+// the shared image for a set up signal: an existing one of the same
+// key, if large enough, else a new one; NULL if the signal has none
+static struct minivosc_image *minivosc_image_get(struct minivosc_signal *sig)
+{
+	unsigned int bytes = minivosc_signal_image_bytes(sig);
+	struct minivosc_image *img, *i;
+
+	if (!bytes)
+		return NULL;
+	img = kzalloc(sizeof(*img), GFP_KERNEL);
+	if (!img)
+		return ERR_PTR(-ENOMEM);
+	minivosc_signal_key(sig, &img->key);
+
+	mutex_lock(&minivosc_images_lock);
+	list_for_each_entry(i, &minivosc_images, list) {
+		if (i->bytes >= bytes && !memcmp(&i->key, &img->key, sizeof(img->key))) {
+			i->users++;
+			mutex_unlock(&minivosc_images_lock);
+			kfree(img);
+			return i;
+		}
+	}
+	// rendered under the lock: others of the same key wait for it
+	img->data = vmalloc(bytes);
+	if (!img->data) {
+		mutex_unlock(&minivosc_images_lock);
+		kfree(img);
+		return ERR_PTR(-ENOMEM);
+	}
+	minivosc_signal_render(sig, img->data, bytes);
+	img->bytes = bytes;
+	img->users = 1;
+	list_add(&img->list, &minivosc_images);
+	mutex_unlock(&minivosc_images_lock);
+	return img;
+}
+
+static void minivosc_image_put(struct minivosc_image *img)
+{
+	if (!img)
+		return;
+	mutex_lock(&minivosc_images_lock);
+	if (--img->users) {
+		mutex_unlock(&minivosc_images_lock);
+		return;
+	}
+	list_del(&img->list);
+	mutex_unlock(&minivosc_images_lock);
+	vfree(img->data);
+	kfree(img);
+}
+
+// called at prepare: the signal of the stream (see minivosc_core.h),
+// with an image if the fill engine copies from one, or for lazy mode -
+// from the shared ones, so equal streams of any card have one copy
+static int minivosc_fill_setup(struct minivosc_pcm *mypcm,
+                        struct snd_pcm_runtime *runtime)
+{
+	struct minivosc_image *img = NULL;
+	int err;
+
+	if (mypcm->lazy && !mypcm->lazy_bounce) {
+		mypcm->lazy_bounce = kmalloc(MINIVOSC_BLOCK * MAX_FRAME_BYTES,
+		                             GFP_KERNEL);
+		if (!mypcm->lazy_bounce)
+			return -ENOMEM;
+	}
+	err = minivosc_signal_setup(&mypcm->sig, runtime->format,
+		runtime->channels, runtime->rate,
+		frames_to_bytes(runtime, runtime->buffer_size), false);
+	if (err < 0)
+		return err;
+	if (mypcm->lazy || (mypcm->engine->flags & MINIVOSC_ENGINE_IMAGE)) {
+		img = minivosc_image_get(&mypcm->sig);
+		if (IS_ERR(img))
+			return PTR_ERR(img);
+	}
+	// the old one only now: it may well be the same
+	minivosc_image_put(mypcm->image);
+	mypcm->image = img;
+	if (img)
+		minivosc_signal_use(&mypcm->sig, img->data);
+	return 0;
+}
+
+static void minivosc_fill_free(struct minivosc_pcm *mypcm)
+{
+	minivosc_signal_free(&mypcm->sig);
+	minivosc_image_put(mypcm->image);
+	mypcm->image = NULL;
+}
+
+// as minivosc_gen, but to user space: straight from the image, else
+// through the bounce block
+static int minivosc_gen_user(struct minivosc_pcm *mypcm, char __user *dst,
+                             unsigned int bytes)
+{
+	struct minivosc_signal *sig = &mypcm->sig;
+	unsigned int size;
+
+	while (bytes) {
+		if (sig->wvf_cache) {
+			size = min(bytes, sig->wvf_span_bytes);
+			if (copy_to_user(dst, sig->wvf_cache + sig->wvf_cache_pos, size))
+				return -EFAULT;
+			sig->wvf_cache_pos = (sig->wvf_cache_pos + size) %
+				sig->wvf_cycle_bytes;
+		} else {
+			size = min(bytes, MINIVOSC_BLOCK * sig->frame_bytes);
+			minivosc_fill_frames(sig, mypcm->lazy_bounce,
+			                     size / sig->frame_bytes);
+			if (copy_to_user(dst, mypcm->lazy_bounce, size))
+				return -EFAULT;
+		}
+		dst += size;
+		bytes -= size;
+	}
+	return 0;
+}
+
+/*
+ *
+ * Loopback functions
+ *
+ */
+// the playback substream feeding capture substream cap, if any:
+// both must run, with the same sample format, rate and channels;
+// called with cable->lock held
+static struct minivosc_pcm *minivosc_loop_peer(struct minivosc_pcm *cap)
+{
+	struct minivosc_pcm *play = cap->cable->streams[SNDRV_PCM_STREAM_PLAYBACK];
+	struct snd_pcm_runtime *crt = cap->substream->runtime;
+	struct snd_pcm_runtime *prt;
+
+	if (!play || !play->running || !cap->running)
+		return NULL;
+	prt = play->substream->runtime;
+	if (prt->format != crt->format || prt->rate != crt->rate ||
+	    prt->channels != crt->channels)
+		return NULL;
+	return play;
+}
+
+// capture hw_params: with the very same geometry as an already set up
+// playback substream, capture straight from the playback buffer instead
+// of copying. The buffer is refcounted, so it stays valid even if the
+// playback side frees or reallocates it.
+// The capture application then has to read the data before the playback
+// one overwrites it, i.e. within the free space of the playback buffer.
+// Called with cable_lock held.
+static bool minivosc_loop_share(struct minivosc_pcm *mypcm,
+                                struct snd_pcm_hw_params *hw_params)
+{
+	struct minivosc_pcm *play;
+	struct snd_pcm_runtime *prt;
+
+	play = mypcm->cable->streams[SNDRV_PCM_STREAM_PLAYBACK];
+	if (!play || !play->buf)
+		return false;
+	prt = play->substream->runtime;
+	if (prt->format != params_format(hw_params) ||
+	    prt->rate != params_rate(hw_params) ||
+	    prt->channels != params_channels(hw_params) ||
+	    prt->dma_bytes != params_buffer_bytes(hw_params))
+		return false;
+
+	if (mypcm->buf != play->buf) {
+		minivosc_buf_put(mypcm);
+		kref_get(&play->buf->ref);
+	}
+	minivosc_buf_set(mypcm, play->buf, params_buffer_bytes(hw_params));
+	spin_lock_irq(&mypcm->cable->lock);
+	mypcm->loop_shared = 1;
+	spin_unlock_irq(&mypcm->cable->lock);
+	dbg("%s: capture %d shares the playback buffer", __func__,
+	    mypcm->substream->number);
+	return true;
+}
+
+// ends the sharing of a buffer between the substream and its peer,
+// before its buffer is freed or set up again: a playback substream
+// leaves the buffer to the capture one (which generates into it again,
+// as its own), and takes a new one at the next hw_params; a capture
+// substream just lets go of it. Called with cable_lock held.
+static void minivosc_loop_unshare(struct minivosc_pcm *mypcm)
+{
+	struct minivosc_pcm *cap = mypcm;
 
-// choose which  copy (fill) algorithm to use -
-// (un)comment as needed, though use only one at a time!
-//~ #define COPYALG_V1
-//~ #define COPYALG_V2
-//~ #define COPYALG_V3
-#define BUFFERMARKS // do we want 'buffer mark' samples or not
+	if (mypcm->substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+		cap = mypcm->cable->streams[SNDRV_PCM_STREAM_CAPTURE];
+		if (!cap || !cap->loop_shared || cap->buf != mypcm->buf)
+			return;
+	} else if (!mypcm->loop_shared) {
+		return;
+	}
+	spin_lock_irq(&mypcm->cable->lock);
+	cap->loop_shared = 0;
+	spin_unlock_irq(&mypcm->cable->lock);
+	minivosc_buf_put(mypcm);
+}
+
+// capture prepare: a buffer shared at hw_params is still that of the
+// playback substream, or not shared anymore; called with cable_lock held
+static void minivosc_loop_recheck(struct minivosc_pcm *mypcm)
+{
+	struct minivosc_pcm *play;
+
+	play = mypcm->cable->streams[SNDRV_PCM_STREAM_PLAYBACK];
+	if (!mypcm->loop_shared || (play && play->buf == mypcm->buf))
+		return;
+	spin_lock_irq(&mypcm->cable->lock);
+	mypcm->loop_shared = 0;
+	spin_unlock_irq(&mypcm->cable->lock);
+	dbg("%s: capture %d does not share the playback buffer anymore",
+	    __func__, mypcm->substream->number);
+}
 
-static void minivosc_xfer_buf(struct minivosc_device *mydev, unsigned int count)
+// capture side of xfer_buf: returns true if the capture buffer is not
+// to be generated into, as it gets the played data instead
+static bool minivosc_loop_capture(struct minivosc_pcm *mypcm)
 {
+	struct minivosc_pcm *play;
+	unsigned long flags;
+	bool ret;
+
+	// irqsave: the fill thread gets here with interrupts on
+	spin_lock_irqsave(&mypcm->cable->lock, flags);
+	play = minivosc_loop_peer(mypcm);
+	if (play && !mypcm->looped) {
+		// the played data goes where we are now: both
+		// positions follow the same clock from here on. The
+		// playback position is moved by its own timer (maybe on
+		// another CPU, under its own lock), so from its snapshot
+		if (mypcm->loop_shared) {
+			struct minivosc_snap snap;
+
+			minivosc_snap_read(play, &snap);
+			mypcm->buf_pos = snap.pos;
+		}
+		mypcm->loop_pos = mypcm->buf_pos;
+	}
+	mypcm->looped = !!play;
+	// never generate into a buffer shared with the playback
+	ret = mypcm->looped || mypcm->loop_shared;
+	spin_unlock_irqrestore(&mypcm->cable->lock, flags);
+	return ret;
+}
 
-	dbg2(">minivosc_xfer_buf: count: %d ", count );
+// playback side of xfer_buf: the bytes just played (from buf_pos on) are
+// copied to the looped capture buffer, at most once around either buffer;
+// looped tells whether they were
+static void minivosc_loop_play(struct minivosc_pcm *play, unsigned int bytes)
+{
+	struct minivosc_pcm *cap;
+	char *src, *dst;
+	unsigned int src_off, dst_off, size;
+
+	spin_lock(&play->cable->lock);
+	cap = play->cable->streams[SNDRV_PCM_STREAM_CAPTURE];
+	play->looped = cap && cap->looped && !cap->loop_shared &&
+		minivosc_loop_peer(cap) == play;
+	if (!play->looped)
+		goto out;
+
+	src = play->substream->runtime->dma_area;
+	dst = cap->substream->runtime->dma_area;
+	src_off = play->buf_pos;
+	dst_off = cap->loop_pos;
+	size = min(play->pcm_buffer_size, cap->pcm_buffer_size);
+	if (bytes > size) {
+		// late timer - only the newest data fits
+		src_off = (src_off + bytes - size) % play->pcm_buffer_size;
+		dst_off = (dst_off + bytes - size) % cap->pcm_buffer_size;
+		bytes = size;
+	}
+	while (bytes) {
+		size = min3(bytes, play->pcm_buffer_size - src_off,
+		            cap->pcm_buffer_size - dst_off);
+		memcpy(dst + dst_off, src + src_off, size);
+		src_off = (src_off + size) % play->pcm_buffer_size;
+		dst_off = (dst_off + size) % cap->pcm_buffer_size;
+		bytes -= size;
+	}
+	cap->loop_pos = dst_off;
+out:
+	spin_unlock(&play->cable->lock);
+}
 
-	switch (mydev->running) {
+/*
+ *
+ * Lazy generation functions
+ *
+ */
+// read() and friends: the data goes right to the user buffer; only a
+// looped capture has its data in the PCM buffer already
+static int minivosc_pcm_copy(struct snd_pcm_substream *ss, int channel,
+                             snd_pcm_uframes_t pos, void __user *buf,
+                             snd_pcm_uframes_t count)
+{
+	struct snd_pcm_runtime *runtime = ss->runtime;
+	struct minivosc_pcm *mypcm = runtime->private_data;
+	unsigned int bytes = frames_to_bytes(runtime, count);
+
+	if (mypcm->looped) {
+		if (copy_to_user(buf, runtime->dma_area +
+		                 frames_to_bytes(runtime, pos), bytes))
+			return -EFAULT;
+		return 0;
+	}
+	minivosc_params_apply(mypcm);
+	return minivosc_gen_user(mypcm, buf, bytes);
+}
+
+// mmap: generates everything up to frame target (as appl_ptr counts),
+// if not done yet (see minivosc_lazy_window). Called by ack and the
+// timer, with mypcm->lock held - but for prepare, before they can
+static void minivosc_lazy_fill(struct minivosc_pcm *mypcm,
+                               snd_pcm_uframes_t target)
+{
+	struct snd_pcm_runtime *runtime = mypcm->substream->runtime;
+	snd_pcm_uframes_t frames;
+
+	frames = minivosc_lazy_window(mypcm->lazy_done, target,
+	                              runtime->buffer_size, runtime->boundary);
+	if (!frames)
+		return;
+	mypcm->lazy_done = target;
+	// the played data is there already
+	if (mypcm->looped)
+		return;
+
+	minivosc_signal_ring(&mypcm->sig, runtime->dma_area,
+	                     mypcm->pcm_buffer_size,
+	                     frames_to_bytes(runtime, (target + runtime->boundary -
+	                                     frames) % runtime->buffer_size),
+	                     frames_to_bytes(runtime, frames), minivosc_gen);
+}
+
+// mmap: the part of the buffer just released by the application is
+// where the next frames will be read from, so generate it now -
+// everything up to one buffer ahead of appl_ptr. The core calls us on
+// read and the like only, not when an mmap reader moves appl_ptr: for
+// that, the timer keeps ahead, see minivosc_lazy_timer
+static int minivosc_pcm_ack(struct snd_pcm_substream *ss)
+{
+	struct snd_pcm_runtime *runtime = ss->runtime;
+	struct minivosc_pcm *mypcm = runtime->private_data;
+	unsigned long flags;
+
+	// read() is served by minivosc_pcm_copy; a shared buffer is
+	// never generated into
+	if (runtime->access == SNDRV_PCM_ACCESS_RW_INTERLEAVED ||
+	    mypcm->loop_shared)
+		return 0;
+	spin_lock_irqsave(&mypcm->lock, flags);
+	minivosc_params_apply(mypcm);
+	minivosc_lazy_fill(mypcm, (runtime->control->appl_ptr +
+	                           runtime->buffer_size) % runtime->boundary);
+	spin_unlock_irqrestore(&mypcm->lock, flags);
+	return 0;
+}
+
+// mmap, from the timer: generates up to a period past the position
+// (head, where the pointer is as of now) - without wakeups, as far as
+// the pointer may run before the next timer - so a reader we never hear
+// from (see minivosc_pcm_ack) finds its data all the same
+static void minivosc_lazy_timer(struct minivosc_pcm *mypcm)
+{
+	struct snd_pcm_runtime *runtime = mypcm->substream->runtime;
+	snd_pcm_uframes_t hw;
+
+	if (runtime->access == SNDRV_PCM_ACCESS_RW_INTERLEAVED)
+		return;
+	hw = mypcm->head - div64_u64(mypcm->head, runtime->boundary) *
+		runtime->boundary;
+	minivosc_params_apply(mypcm);
+	minivosc_lazy_fill(mypcm, minivosc_lazy_target(hw,
+		ACCESS_ONCE(runtime->control->appl_ptr),
+		mypcm->nowake_span ? minivosc_stream_lead(mypcm) :
+		                     runtime->period_size,
+		runtime->buffer_size, runtime->boundary));
+}
+
+static void minivosc_xfer_buf(struct minivosc_pcm *mypcm, unsigned int count)
+{
+
+	cycles_t t0 = get_cycles();
+	bool own_pos = false;
+
+	switch (mypcm->running) {
+	case CABLE_PLAYBACK:
+		minivosc_loop_play(mypcm, count);
+		break;
 	case CABLE_CAPTURE:
-		minivosc_fill_capture_buf(mydev, count);
+		// nothing to generate, if the playback side feeds us
+		if (minivosc_loop_capture(mypcm))
+			break;
+		// lazy: generated later, by whoever reads it (or
+		// just a period ahead, with mmap)
+		if (mypcm->lazy) {
+			minivosc_lazy_timer(mypcm);
+			break;
+		}
+		minivosc_params_apply(mypcm);
+		trace_minivosc_fill_start(mypcm->substream, mypcm->buf_pos, count);
+		own_pos = minivosc_fill_capture_buf(mypcm, count);
+		trace_minivosc_fill_end(mypcm->substream, count);
 		break;
 	}
+	this_cpu_add(mypcm->stats->fill_cycles, get_cycles() - t0);
+	this_cpu_inc(mypcm->stats->fills);
+	this_cpu_add(mypcm->stats->bytes, count);
 
-		if (mydev->running) {
-// activate this buf_pos calculation, either if V3 is defined,
-//  or if no COPYALG is defined (which also handles lone BUFFERMARKS)
-#if defined(COPYALG_V3) || !(defined(COPYALG_V1) || defined(COPYALG_V2) || defined(COPYALG_V3))
+		// the v1 and v2 engines move buf_pos themselves
+		if (mypcm->running && !own_pos) {
 			// here the (auto)increase of buf_pos is handled
-			mydev->buf_pos += count;
-			mydev->buf_pos %= mydev->pcm_buffer_size;
-			dbg2(">	: mydev->buf_pos: %d ", mydev->buf_pos); // */
-#endif
+			mypcm->buf_pos += count;
+			mypcm->buf_pos %= mypcm->pcm_buffer_size;
 		}
 }
 
-static void minivosc_fill_capture_buf(struct minivosc_device *mydev, unsigned int bytes)
+/*
+ *
+ * Fill engines
+ *
+ */
+// the lifted wvfdat of the current wrap of the substream
+static void minivosc_wvf_lift(const struct minivosc_pcm *mypcm, char *lifted)
 {
-	char *dst = mydev->substream->runtime->dma_area;
-	unsigned int dst_off = mydev->buf_pos; // buf_pos is in bytes, not in samples !
-	float wrdat; // was char - value to fill silent_size with
+	int mylift = mypcm->sig.wvf_lift*10 - 10;
+	int i;
+
+	// create modified - 'lifted' - values of waveform:
+	for (i=0; i<wvfsz; i++) {
+		lifted[i] = wvfdat[i]+mylift;
+	}
+}
+
+// v1: walks wvfdat with memcpy, lifting it on each wrap; moves
+// buf_pos itself
+static void minivosc_fill_v1(struct minivosc_pcm *mypcm, unsigned int bytes)
+{
+	char *dst = mypcm->substream->runtime->dma_area;
+	char lifted[WVF_SIZE];
 	unsigned int dpos = 0; //added
-#if defined(COPYALG_V1) || defined(COPYALG_V2)
-	int i = 0; //added
-	int mylift = 0; //added
-#endif
-#if defined(COPYALG_V1)
 	unsigned int remain = 0; //added
 	unsigned int remain2 = 0; //added
 	unsigned int wvftocopy = 0; //added
-#endif
-#if defined(COPYALG_V2)
-	int j = 0; //added
-#endif
-#if defined(COPYALG_V3)
-#endif
 
-
-	dbg2("_ minivosc_fill_capture_buf ss %d bs %d bytes %d buf_pos %d sizeof %ld jiffies %lu", mydev->silent_size, mydev->pcm_buffer_size, bytes, dst_off, sizeof(*dst), jiffies);
-
-#if defined(COPYALG_V1)
 	// loop v1.. fill waveform until end of 'bytes'..
 	// using memcpy for copying/filling
 	//*
-	while (dpos < bytes-1)
+	minivosc_wvf_lift(mypcm, lifted);
+	while (dpos < bytes)
 	{
-		mylift = mydev->wvf_lift*10 - 10;
-		// create modified - 'lifted' - values of waveform:
-		for (i=0; i<wvfsz; i++) {
-			wvfdat[i] = wvfdat2[i]+mylift;
-		}
-
 		remain = bytes - dpos;
-		remain2 = mydev->pcm_buffer_size - mydev->buf_pos;
-		if (remain < wvfsz) wvftocopy = remain; //not wvfsz - remain!
-		if (remain2 < wvfsz) wvftocopy = remain2; //also see if "big" PCM buffer wraps!
-		else wvftocopy = wvfsz;
-		if (mydev->wvf_pos > 0) wvftocopy -= mydev->wvf_pos;
+		remain2 = mypcm->pcm_buffer_size - mypcm->buf_pos;
+		wvftocopy = wvfsz - mypcm->sig.wvf_pos;
+		if (remain < wvftocopy) wvftocopy = remain; //not wvfsz - remain!
+		if (remain2 < wvftocopy) wvftocopy = remain2; //also see if "big" PCM buffer wraps!
 
-		dbg2("::: buf_pos %d; dpos %d; wvf_pos %d; wvftocopy %d; remain %d; remain2 %d; wvfsz %d; wvf_lift %d", mydev->buf_pos, dpos, mydev->wvf_pos, wvftocopy, remain, remain2, wvfsz, mydev->wvf_lift);
+		dbg2("::: buf_pos %d; dpos %d; wvf_pos %d; wvftocopy %d; remain %d; remain2 %d; wvfsz %d; wvf_lift %d", mypcm->buf_pos, dpos, mypcm->sig.wvf_pos, wvftocopy, remain, remain2, wvfsz, mypcm->sig.wvf_lift);
 
-		memcpy(dst + mydev->buf_pos, &wvfdat[mydev->wvf_pos], wvftocopy);
+		memcpy(dst + mypcm->buf_pos, &lifted[mypcm->sig.wvf_pos], wvftocopy);
 
 		dpos += wvftocopy;
-		mydev->buf_pos += wvftocopy; //added if there isn't (auto)increase of buf_pos in xfer_buf
-		mydev->wvf_pos += wvftocopy;
-		if (mydev->wvf_pos >= wvfsz) { // we should wrap waveform here..
-			mydev->wvf_pos -= wvfsz;
+		mypcm->buf_pos += wvftocopy; //added if there isn't (auto)increase of buf_pos in xfer_buf
+		mypcm->sig.wvf_pos += wvftocopy;
+		if (mypcm->sig.wvf_pos >= wvfsz) { // we should wrap waveform here..
+			mypcm->sig.wvf_pos -= wvfsz;
 			// also handle lift here..
-			mydev->wvf_lift++;
-			if (mydev->wvf_lift >=4) mydev->wvf_lift = 0;
+			mypcm->sig.wvf_lift++;
+			if (mypcm->sig.wvf_lift >=4) mypcm->sig.wvf_lift = 0;
+			minivosc_wvf_lift(mypcm, lifted);
 		}
-		//added if there isn't (auto)increase of buf_pos in xfer_buf
-		// there may be some misalignments here still, though...
-		if (mydev->buf_pos >= mydev->pcm_buffer_size) {
-			mydev->buf_pos = 0;
-			break; //we don;t really need this.. but maybe here...?
-		}
-		if (dpos >= bytes-1) break;
+		//added if there isn't (auto)increase of buf_pos in xfer_buf;
+		// wraps, so buf_pos moves by exactly bytes, as the clock says
+		if (mypcm->buf_pos >= mypcm->pcm_buffer_size)
+			mypcm->buf_pos = 0;
 	} // end loop v1 */
-#endif //defined(COPYALG_V1)
+}
+
+// v2: as v1, but byte by byte
+static void minivosc_fill_v2(struct minivosc_pcm *mypcm, unsigned int bytes)
+{
+	char *dst = mypcm->substream->runtime->dma_area;
+	char lifted[WVF_SIZE];
+	unsigned int dpos = 0; //added
+	int j = 0; //added
 
-#if defined(COPYALG_V2)
 	// hmm... for this loop, v2,  I was getting prepare signature (45), if
-	//   mydev->buf_pos autoincrements (wraps) in minivosc_xfer_buf ;
+	//   mypcm->buf_pos autoincrements (wraps) in minivosc_xfer_buf ;
 	// however, for more correct, we calculate 'buf_pos' here instead..
 	// using direct assignment of elements for copying/filling
 	//*
+	minivosc_wvf_lift(mypcm, lifted);
 	for (j=0; j<bytes; j++) {
-		mylift = mydev->wvf_lift*10 - 10;
-		for (i=0; i<sizeof(wvfdat); i++) {
-			wvfdat[i] = wvfdat2[i]+mylift;
-		}
-
-		dst[mydev->buf_pos] = wvfdat[mydev->wvf_pos];
-		dpos++; mydev->buf_pos++;
-		mydev->wvf_pos++;
+		dst[mypcm->buf_pos] = lifted[mypcm->sig.wvf_pos];
+		dpos++; mypcm->buf_pos++;
+		mypcm->sig.wvf_pos++;
 
-		if (mydev->wvf_pos >= wvfsz) { // we should wrap waveform here..
-			mydev->wvf_pos = 0;
+		if (mypcm->sig.wvf_pos >= wvfsz) { // we should wrap waveform here..
+			mypcm->sig.wvf_pos = 0;
 			// also handle lift here..
-			mydev->wvf_lift++;
-			if (mydev->wvf_lift >=4) mydev->wvf_lift = 0;
+			mypcm->sig.wvf_lift++;
+			if (mypcm->sig.wvf_lift >=4) mypcm->sig.wvf_lift = 0;
+			minivosc_wvf_lift(mypcm, lifted);
 		}
-		if (mydev->buf_pos >= mydev->pcm_buffer_size) {
-			mydev->buf_pos = 0;
+		if (mypcm->buf_pos >= mypcm->pcm_buffer_size) {
+			mypcm->buf_pos = 0;
 			//break; //we don;t really need this
 		}
 		if (dpos >= bytes) break;
 	} // end loop v2 */
-#endif //defined(COPYALG_V2)
+}
+
+// v3: walks wvfdat (unlifted) as copy_play_buf in aloop-kernel.c,
+// then handles silent_size
+static void minivosc_fill_v3(struct minivosc_pcm *mypcm, unsigned int bytes)
+{
+	char *dst = mypcm->substream->runtime->dma_area;
+	unsigned int dst_off = mypcm->buf_pos; // buf_pos is in bytes, not in samples !
+	u32 wrdat; // was char - value to fill silent_size with
+	unsigned int dpos = 0; //added
+	unsigned int left = bytes;
 
-#if defined(COPYALG_V3)
 	// as in copy_play_buf in aloop-kernel.c, where we had:
 	//~ char *src = play->substream->runtime->dma_area;
 	//~ char *dst = capt->substream->runtime->dma_area;
@@ -736,67 +3105,56 @@ static void minivosc_fill_capture_buf(struct minivosc_device *mydev, unsigned in
 	// using memcpy for copying/filling
 
 	for (;;) {
-		unsigned int size = bytes;
-		if (mydev->wvf_pos + size > wvfsz)
-			size = wvfsz - mydev->wvf_pos;
-		if (dst_off + size > mydev->pcm_buffer_size)
-			size = mydev->pcm_buffer_size - dst_off;
+		unsigned int size = left;
+		if (mypcm->sig.wvf_pos + size > wvfsz)
+			size = wvfsz - mypcm->sig.wvf_pos;
+		if (dst_off + size > mypcm->pcm_buffer_size)
+			size = mypcm->pcm_buffer_size - dst_off;
 
-		memcpy(dst + dst_off, wvfdat + mydev->wvf_pos, size);
+		memcpy(dst + dst_off, wvfdat + mypcm->sig.wvf_pos, size);
 
-		if (size < mydev->silent_size)
-			mydev->silent_size -= size;
+		if (size < mypcm->silent_size)
+			mypcm->silent_size -= size;
 		else
-			mydev->silent_size = 0;
-		bytes -= size;
-		if (!bytes)
+			mypcm->silent_size = 0;
+		left -= size;
+		if (!left)
 			break;
-		mydev->wvf_pos = (mydev->wvf_pos + size) % wvfsz;
-		dst_off = (dst_off + size) % mydev->pcm_buffer_size;
-	}
-#endif //defined(COPYALG_V3)
-
-#if defined(BUFFERMARKS)
-	//* //set buffer marks
-	//-------------
-	//these two shouldn't change in repeated calls of this func:
-	memset(dst+1, 160, 1); // mark start of pcm buffer
-	memset(dst + mydev->pcm_buffer_size - 2, 140, 1); // mark end of pcm buffer
-
-	memset(dst + dst_off, 120, 1); // mark start of this fill_capture_buf.
-	if (dst_off==0) memset(dst + dst_off, 250, 1); // different mark if offset is zero
-	// note - if marking end at dst + dst_off + bytes, it gets overwritten by next run
-	memset(dst + dst_off + bytes - 2, 90, 1); // mark end fill_capture_buf.
-	// end set buffer marks */
-#endif //defined(BUFFERMARKS)
-
-	if (mydev->silent_size >= mydev->pcm_buffer_size)
+		mypcm->sig.wvf_pos = (mypcm->sig.wvf_pos + size) % wvfsz;
+		dst_off = (dst_off + size) % mypcm->pcm_buffer_size;
+	}
+
+	if (mypcm->silent_size >= mypcm->pcm_buffer_size)
 		return;
 
 	// NOTE: usually, the code returns by now -
 	// - it doesn't even execute past this point!
 	// from here on, apparently silent_size should be handled..
 
-	if (mydev->silent_size + bytes > mydev->pcm_buffer_size)
-		bytes = mydev->pcm_buffer_size - mydev->silent_size;
+	if (mypcm->silent_size + bytes > mypcm->pcm_buffer_size)
+		bytes = mypcm->pcm_buffer_size - mypcm->silent_size;
 
-	wrdat = -0.2; // value to copy, instead of 0 for silence (if needed)
+	// value to copy, instead of 0 for silence (if needed): the bits of
+	// the float -0.2, as kernel code must not do floating point
+	wrdat = 0xbe4ccccd;
 
 	for (;;) {
 		unsigned int size = bytes;
 		dpos = 0; //added
 		dbg2("_ clearrr..	%d", bytes);
-		if (dst_off + size > mydev->pcm_buffer_size)
-			size = mydev->pcm_buffer_size - dst_off;
+		if (dst_off + size > mypcm->pcm_buffer_size)
+			size = mypcm->pcm_buffer_size - dst_off;
 
 		//memset(dst + dst_off, 255, size); //0, size);
 		while (dpos < size)
 		{
-			memcpy(dst + dst_off + dpos, &wrdat, sizeof(wrdat));
+			// the last one may not fit whole
+			memcpy(dst + dst_off + dpos, &wrdat,
+			       min_t(unsigned int, sizeof(wrdat), size - dpos));
 			dpos += sizeof(wrdat);
 			if (dpos >= size) break;
 		}
-		mydev->silent_size += size;
+		mypcm->silent_size += size;
 		bytes -= size;
 		if (!bytes)
 			break;
@@ -804,6 +3162,310 @@ static void minivosc_fill_capture_buf(struct minivosc_device *mydev, unsigned in
 	}
 }
 
+// the generator engines: bytes at buf_pos, by gen (contiguous);
+// silent_size is left alone, so nothing overwrites this
+static void minivosc_fill_ring(struct minivosc_pcm *mypcm, unsigned int bytes,
+                               minivosc_gen_t gen)
+{
+	minivosc_signal_ring(&mypcm->sig, mypcm->substream->runtime->dma_area,
+	                     mypcm->pcm_buffer_size, mypcm->buf_pos, bytes, gen);
+}
+
+// memcpy: from the signal image, see minivosc_gen
+static void minivosc_fill_memcpy(struct minivosc_pcm *mypcm, unsigned int bytes)
+{
+	minivosc_fill_ring(mypcm, bytes, minivosc_gen);
+}
+
+// words: from the signal image too, see minivosc_gen_words
+static void minivosc_fill_words(struct minivosc_pcm *mypcm, unsigned int bytes)
+{
+	minivosc_fill_ring(mypcm, bytes, minivosc_gen_words);
+}
+
+// live: runs the oscillator for every frame, no image
+static void minivosc_fill_live(struct minivosc_pcm *mypcm, unsigned int bytes)
+{
+	minivosc_fill_ring(mypcm, bytes, minivosc_gen);
+}
+
+#ifdef CONFIG_X86
+// sse2: as live, for FLOAT_LE, but converting the Q31 samples to
+// float four at a time (cvtdq2ps, then * 2^-31), as in lib/raid6/sse2.c
+static const u32 minivosc_sse2_scale[4] __aligned(16) = {
+	0x30000000, 0x30000000, 0x30000000, 0x30000000 // 2^-31
+};
+
+static bool minivosc_sse2_usable(void)
+{
+	return boot_cpu_has(X86_FEATURE_XMM2);
+}
+
+static void minivosc_gen_sse2(struct minivosc_signal *sig, char *dst,
+                              unsigned int bytes)
+{
+	s32 buf[MINIVOSC_BLOCK] __aligned(16);
+	unsigned int frames = bytes / sig->frame_bytes;
+	unsigned int n, i;
+
+	// the timer callback may well find the FPU unusable; per channel
+	// oscillators are stored channel by channel, which is done there
+	if (!irq_fpu_usable() || minivosc_signal_voiced(sig)) {
+		minivosc_fill_frames(sig, dst, frames);
+		return;
+	}
+
+	kernel_fpu_begin();
+	asm volatile("movaps %0,%%xmm7" : : "m" (minivosc_sse2_scale[0]));
+	while (frames) {
+		n = min_t(unsigned int, frames, MINIVOSC_BLOCK);
+		minivosc_osc_render(sig, buf, n);
+		for (i = 0; i < n; i += 4)
+			asm volatile("movdqa %1,%%xmm0\n\t"
+			             "cvtdq2ps %%xmm0,%%xmm0\n\t"
+			             "mulps %%xmm7,%%xmm0\n\t"
+			             "movdqa %%xmm0,%0"
+			             : "=m" (*(s32 (*)[4])&buf[i])
+			             : "m" (*(const s32 (*)[4])&buf[i]));
+		// the samples are float bits now, stored as they are
+		sig->store_bits(buf, dst, n, sig->channels);
+		dst += n * sig->frame_bytes;
+		frames -= n;
+	}
+	kernel_fpu_end();
+}
+
+static void minivosc_fill_sse2(struct minivosc_pcm *mypcm, unsigned int bytes)
+{
+	minivosc_fill_ring(mypcm, bytes, minivosc_gen_sse2);
+}
+#endif
+
+static const struct minivosc_engine minivosc_engines[] =
+{
+	// the default: copies, or live if the image would be too long
+	{ "memcpy", minivosc_fill_memcpy, NULL, 0, MINIVOSC_ENGINE_IMAGE },
+	{ "words", minivosc_fill_words, NULL, 0, MINIVOSC_ENGINE_IMAGE },
+	{ "live", minivosc_fill_live, NULL, 0, 0 },
+#ifdef CONFIG_X86
+	{ "sse2", minivosc_fill_sse2, minivosc_sse2_usable,
+	  SNDRV_PCM_FMTBIT_FLOAT_LE, 0 },
+#endif
+	// the originals - these write single bytes, so they serve U8
+	// mono streams only (see minivosc_engine_for)
+	{ "v1", minivosc_fill_v1, NULL, SNDRV_PCM_FMTBIT_U8,
+	  MINIVOSC_ENGINE_LEGACY | MINIVOSC_ENGINE_OWN_POS },
+	{ "v2", minivosc_fill_v2, NULL, SNDRV_PCM_FMTBIT_U8,
+	  MINIVOSC_ENGINE_LEGACY | MINIVOSC_ENGINE_OWN_POS },
+	{ "v3", minivosc_fill_v3, NULL, SNDRV_PCM_FMTBIT_U8,
+	  MINIVOSC_ENGINE_LEGACY },
+};
+
+// chosen at load time, by minivosc_engine_init
+static const struct minivosc_engine *minivosc_engine = &minivosc_engines[0];
+
+// whether engine e can fill streams of format and channels
+static bool minivosc_engine_serves(const struct minivosc_engine *e,
+                                   snd_pcm_format_t format,
+                                   unsigned int channels)
+{
+	if (e->formats && !(e->formats & (1ULL << (__force int)format)))
+		return false;
+	return !(e->flags & MINIVOSC_ENGINE_LEGACY) || channels == 1;
+}
+
+// tells if the chosen engine serves no format and channel count of
+// hw (of the device of profile): minivosc_engine_for leaves all of its
+// streams to the default one
+static void minivosc_engine_note(const struct snd_pcm_hardware *hw,
+                                 const char *profile)
+{
+	unsigned int f, ch;
+
+	for (f = 0; f <= (__force unsigned int)SNDRV_PCM_FORMAT_LAST; f++) {
+		if (!(hw->formats & (1ULL << f)))
+			continue;
+		for (ch = hw->channels_min; ch <= hw->channels_max; ch++)
+			if (minivosc_engine_serves(minivosc_engine,
+			                           (__force snd_pcm_format_t)f, ch))
+				return;
+	}
+	printk(KERN_INFO "minivosc: profile %s filled by engine %s, not %s\n",
+	       profile, minivosc_engines[0].name, minivosc_engine->name);
+}
+
+// the engine for a stream: engines for some formats (or channel
+// counts) only leave the others to the default one
+static const struct minivosc_engine *minivosc_engine_for(struct snd_pcm_runtime *runtime)
+{
+	const struct minivosc_engine *e = minivosc_engine;
+
+	if (!minivosc_engine_serves(e, runtime->format, runtime->channels))
+		e = &minivosc_engines[0];
+	return e;
+}
+
+#define MINIVOSC_BENCH_JIFFIES_LOG	4
+#define MINIVOSC_BENCH_FRAMES	1024	// per fill, one period
+#define MINIVOSC_BENCH_BUFFER	8192	// frames
+
+// as raid6_select_algo(): fills as many periods as it can, in a fixed
+// number of jiffies, into a FLOAT_LE stereo buffer with a 997 Hz sine;
+// returns bytes per jiffy, or < 0
+static long minivosc_engine_bench(const struct minivosc_engine *e,
+                                  struct minivosc_pcm *mypcm)
+{
+	struct snd_pcm_runtime *runtime = mypcm->substream->runtime;
+	unsigned long j0, j1;
+	long bytes = 0;
+	unsigned int period;
+	int err;
+
+	mypcm->engine = e;
+	err = minivosc_fill_setup(mypcm, runtime);
+	if (err < 0)
+		return err;
+	mypcm->buf_pos = 0;
+	period = frames_to_bytes(runtime, MINIVOSC_BENCH_FRAMES);
+
+	preempt_disable();
+	j0 = jiffies;
+	while ((j1 = jiffies) == j0)
+		cpu_relax();
+	while (time_before(jiffies, j1 + (1 << MINIVOSC_BENCH_JIFFIES_LOG))) {
+		e->fill(mypcm, period);
+		mypcm->buf_pos = (mypcm->buf_pos + period) % mypcm->pcm_buffer_size;
+		bytes += period;
+	}
+	preempt_enable();
+
+	minivosc_fill_free(mypcm);
+	return bytes >> MINIVOSC_BENCH_JIFFIES_LOG;
+}
+
+static const struct minivosc_engine *minivosc_engine_pick(void)
+{
+	const struct minivosc_engine *e, *best = &minivosc_engines[0];
+	struct snd_pcm_substream *ss;
+	struct snd_pcm_runtime *runtime;
+	struct minivosc_pcm *mypcm;
+	long speed, best_speed = -1;
+
+	// a substream of our own, just good enough for the engines
+	ss = kzalloc(sizeof(*ss), GFP_KERNEL);
+	runtime = kzalloc(sizeof(*runtime), GFP_KERNEL);
+	mypcm = kzalloc(sizeof(*mypcm), GFP_KERNEL);
+	if (!ss || !runtime || !mypcm)
+		goto out;
+	runtime->format = SNDRV_PCM_FORMAT_FLOAT_LE;
+	runtime->channels = 2;
+	runtime->rate = 48000;
+	runtime->frame_bits = 64;
+	runtime->buffer_size = MINIVOSC_BENCH_BUFFER;
+	runtime->dma_area = vmalloc(frames_to_bytes(runtime, runtime->buffer_size));
+	if (!runtime->dma_area)
+		goto out;
+	ss->runtime = runtime;
+	mypcm->substream = ss;
+	mypcm->sig.osc_wave = MINIVOSC_WAVE_SINE;
+	mypcm->sig.osc_freq = 997;
+	mypcm->sig.osc_amp = 100;
+	mypcm->pcm_buffer_size = frames_to_bytes(runtime, runtime->buffer_size);
+
+	for (e = minivosc_engines; e < minivosc_engines + ARRAY_SIZE(minivosc_engines); e++) {
+		if (e->flags & MINIVOSC_ENGINE_LEGACY)
+			continue;
+		if (e->usable && !e->usable())
+			continue;
+		speed = minivosc_engine_bench(e, mypcm);
+		if (speed < 0)
+			continue;
+		printk(KERN_INFO "minivosc: %-8s %5ld MB/s\n", e->name,
+		       (speed * HZ) >> 20);
+		if (speed > best_speed) {
+			best = e;
+			best_speed = speed;
+		}
+	}
+	vfree(runtime->dma_area);
+out:
+	kfree(mypcm);
+	kfree(runtime);
+	kfree(ss);
+	return best;
+}
+
+// at load time: the engine named by fill_engine, or the fastest one
+static int minivosc_engine_init(void)
+{
+	const struct minivosc_engine *e;
+
+	if (fill_engine && strcmp(fill_engine, "auto")) {
+		for (e = minivosc_engines; e < minivosc_engines + ARRAY_SIZE(minivosc_engines); e++)
+			if (!strcmp(e->name, fill_engine))
+				break;
+		if (e == minivosc_engines + ARRAY_SIZE(minivosc_engines)) {
+			printk(KERN_ERR "minivosc: unknown fill_engine %s\n", fill_engine);
+			return -EINVAL;
+		}
+		if (e->usable && !e->usable()) {
+			printk(KERN_ERR "minivosc: fill_engine %s not supported by this CPU\n",
+			       fill_engine);
+			return -ENODEV;
+		}
+	} else {
+		e = minivosc_engine_pick();
+	}
+	minivosc_engine = e;
+	printk(KERN_INFO "minivosc: using %s fill engine\n", e->name);
+	return 0;
+}
+
+// returns true if the fill engine moved buf_pos itself
+static bool minivosc_fill_capture_buf(struct minivosc_pcm *mypcm, unsigned int bytes)
+{
+	struct snd_pcm_runtime *runtime = mypcm->substream->runtime;
+	char *dst = runtime->dma_area;
+	unsigned int dst_off = mypcm->buf_pos; // buf_pos is in bytes, not in samples !
+	unsigned long flags;
+	bool injected = false;
+
+	// a userspace producer feeds us: its data goes straight in
+	// (irqsave, as in minivosc_loop_capture)
+	spin_lock_irqsave(&mypcm->cable->lock, flags);
+	if (mypcm->cable->ring) {
+		minivosc_inject_drain(&mypcm->cable->ring->inj, &mypcm->sig,
+		                      snd_pcm_format_silence_64(runtime->format),
+		                      dst, mypcm->pcm_buffer_size, dst_off, bytes);
+		injected = true;
+	}
+	spin_unlock_irqrestore(&mypcm->cable->lock, flags);
+	if (!injected)
+		mypcm->engine->fill(mypcm, bytes);
+
+	// the bytes just filled end at the head, ahead of the position
+	// or behind it
+	if (mypcm->probe.interval)
+		minivosc_probe_mark(&mypcm->probe, &mypcm->pos, mypcm->head,
+		                    ktime_to_ns(mypcm->last_time), dst,
+		                    mypcm->pcm_buffer_size, dst_off, bytes);
+
+	if (buffer_marks) {
+		//* //set buffer marks
+		//-------------
+		//these two shouldn't change in repeated calls of this func:
+		memset(dst+1, 160, 1); // mark start of pcm buffer
+		memset(dst + mypcm->pcm_buffer_size - 2, 140, 1); // mark end of pcm buffer
+
+		memset(dst + dst_off, 120, 1); // mark start of this fill_capture_buf.
+		if (dst_off==0) memset(dst + dst_off, 250, 1); // different mark if offset is zero
+		// note - if marking end at dst + dst_off + bytes, it gets overwritten by next run
+		memset(dst + dst_off + bytes - 2, 90, 1); // mark end fill_capture_buf.
+		// end set buffer marks */
+	}
+	return !injected && (mypcm->engine->flags & MINIVOSC_ENGINE_OWN_POS);
+}
+
 
 
 
@@ -817,7 +3479,12 @@ static void minivosc_fill_capture_buf(struct minivosc_device *mydev, unsigned in
 // however, since we do no special allocations, we need not free anything
 static int minivosc_pcm_free(struct minivosc_device *chip)
 {
+	unsigned int i;
+
 	dbg("%s", __func__);
+	// no substream is left to read them
+	for (i = 0; i < MAX_PCM_DEVS; i++)
+		kfree(rcu_dereference_protected(chip->devs[i].params, 1));
 	return 0;
 }
 
@@ -850,22 +3517,30 @@ static void minivosc_unregister_all(void)
 
 static int __init alsa_card_minivosc_init(void)
 {
-	int i, err, cards;
+	int i, err, ncards;
 
 	dbg("%s", __func__);
+	err = minivosc_engine_init();
+	if (err < 0)
+		return err;
+	err = minivosc_sched_init();
+	if (err < 0)
+		return err;
 	err = platform_driver_register(&minivosc_driver);
 
-	if (err < 0)
+	if (err < 0) {
+		minivosc_sched_exit();
 		return err;
+	}
 
 
-	cards = 0;
+	ncards = 0;
 
 	for (i = 0; i < SNDRV_CARDS; i++)
 	{
 		struct platform_device *device;
 
-		if (!enable[i])
+		if (!enable[i] && i >= cards)
 			continue;
 
 		device = platform_device_register_simple(SND_MINIVOSC_DRIVER,
@@ -881,15 +3556,16 @@ static int __init alsa_card_minivosc_init(void)
 		}
 
 		devices[i] = device;
-		cards++;
+		ncards++;
 	}
 
-	if (!cards)
+	if (!ncards)
 	{
 #ifdef MODULE
 		printk(KERN_ERR "minivosc-alsa: No enabled, not found or device busy\n");
 #endif
 		minivosc_unregister_all();
+		minivosc_sched_exit();
 		return -ENODEV;
 	}
 
@@ -900,6 +3576,7 @@ static void __exit alsa_card_minivosc_exit(void)
 {
 	dbg("%s", __func__);
 	minivosc_unregister_all();
+	minivosc_sched_exit();
 }
 
 module_init(alsa_card_minivosc_init)
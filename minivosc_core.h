@@ -0,0 +1,1260 @@
+/*
+ *  Minimal virtual oscillator (minivosc) soundcard - generator core
+ *
+ *  The signal generator, the position arithmetic and the injection
+ *  ring consumer of the driver, without anything ALSA or timer
+ *  specific, so the very same code also builds in userspace (see
+ *  tools/), for tests and benchmarks.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ */
+
+#ifndef MINIVOSC_CORE_H
+#define MINIVOSC_CORE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/compiler.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/gcd.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <asm/barrier.h>
+#include <asm/unaligned.h>
+#include <sound/asound.h>
+#else
+#include "minivosc_shim.h"
+#endif
+#include "minivosc_inject.h"
+
+/*
+ *
+ * Position arithmetic
+ *
+ */
+// positions are kept as fractions with nanosecond resolution:
+// one frame of position is NSEC_PER_SEC fractional units
+#define frame_pos(x)	div_u64((x), NSEC_PER_SEC)
+#define frac_pos(x)	((u64)(x) * NSEC_PER_SEC)
+
+struct minivosc_pos
+{
+	u64 irq_pos;		/* fractional IRQ position (frames * ns) */
+	u64 period_size_frac;
+	u64 frames;		/* whole frames since the start, never capped */
+	unsigned int rate;	/* frames per second */
+	unsigned int period_frames;
+	unsigned int buffer_frames;
+};
+
+#define MINIVOSC_POS_PERIOD	1 // a period ended
+#define MINIVOSC_POS_CATCHUP	2 // ... and at least one more before it
+
+static inline void minivosc_pos_setup(struct minivosc_pos *pos,
+                                      unsigned int rate,
+                                      unsigned int period_frames,
+                                      unsigned int buffer_frames)
+{
+	pos->rate = rate;
+	pos->period_frames = period_frames;
+	pos->buffer_frames = buffer_frames;
+	pos->period_size_frac = frac_pos(period_frames);
+}
+
+// ns from the last update to the end of the current period
+static inline u64 minivosc_pos_period_ns(const struct minivosc_pos *pos)
+{
+	u64 tick = pos->period_size_frac - pos->irq_pos;
+
+	return div_u64(tick + pos->rate - 1, pos->rate);
+}
+
+// the link time of frame f: ns from the start at which the position
+// reached it (f * NSEC_PER_SEC / rate, rounded up)
+static inline u64 minivosc_frame_link_ns(u64 f, unsigned int rate)
+{
+	u32 rem;
+	u64 secs = div_u64_rem(f, rate, &rem);
+
+	return secs * NSEC_PER_SEC +
+		div_u64((u64)rem * NSEC_PER_SEC + rate - 1, rate);
+}
+
+// the link time of the position, at its current whole frame
+static inline u64 minivosc_pos_link_ns(const struct minivosc_pos *pos)
+{
+	return minivosc_frame_link_ns(pos->frames, pos->rate);
+}
+
+// the whole frames the position has reached ns after the start: the
+// inverse of minivosc_frame_link_ns, so the clock alone tells where the
+// position is, exactly as minivosc_pos_advance would have counted
+static inline u64 minivosc_link_frames(u64 ns, unsigned int rate)
+{
+	u32 rem;
+	u64 secs = div_u64_rem(ns, NSEC_PER_SEC, &rem);
+
+	return secs * rate + div_u64((u64)rem * rate, NSEC_PER_SEC);
+}
+
+// whole frames from the position to the end of its period
+static inline unsigned int minivosc_pos_period_left(const struct minivosc_pos *pos)
+{
+	return pos->period_frames - (unsigned int)frame_pos(pos->irq_pos);
+}
+
+// ns since the position reached its current whole frame; the time of
+// the last update minus this is exactly the link time above
+static inline u64 minivosc_pos_frame_age_ns(const struct minivosc_pos *pos)
+{
+	u32 frac;
+
+	div_u64_rem(pos->irq_pos, NSEC_PER_SEC, &frac);
+	return frac / pos->rate;
+}
+
+/*
+ * advance by delta ns; returns the frames to transfer, and what
+ * happened to the periods in *elapsed (MINIVOSC_POS_*).
+ *
+ * All in 64 bits: irq_pos stays below one period plus one second
+ * (384000 frames * NSEC_PER_SEC), and the frames of whole seconds
+ * of delay never go through irq_pos at all, so nothing overflows
+ * however late we are, and no rounding ever accumulates. Data older
+ * than a buffer would only be overwritten, so no more than a buffer
+ * (plus the position within it) is returned - the position still
+ * moves by the full amount.
+ */
+static inline u64 minivosc_pos_advance(struct minivosc_pos *pos, u64 delta,
+                                       unsigned int *elapsed)
+{
+	u64 last_pos, count, secs = 0;
+	u32 rem;
+
+	*elapsed = 0;
+	// count whole frames, so multi-byte formats are never split
+	last_pos = frame_pos(pos->irq_pos);
+	if (likely(delta < NSEC_PER_SEC)) {
+		pos->irq_pos += delta * pos->rate;
+	} else {
+		// (very) late: whole seconds are whole frames; only their
+		// part of a period goes to irq_pos
+		secs = (u64)div_u64_rem(delta, NSEC_PER_SEC, &rem) * pos->rate;
+		pos->irq_pos += frac_pos(do_div(secs, pos->period_frames)) +
+			(u64)rem * pos->rate;
+		secs *= pos->period_frames; // whole periods skipped
+	}
+	count = secs + frame_pos(pos->irq_pos) - last_pos;
+	pos->frames += count;
+
+	if (pos->irq_pos >= pos->period_size_frac) {
+		pos->irq_pos -= pos->period_size_frac;
+		*elapsed = MINIVOSC_POS_PERIOD;
+		// late enough to have skipped a whole period end
+		if (pos->irq_pos >= pos->period_size_frac || secs) {
+			*elapsed |= MINIVOSC_POS_CATCHUP;
+			div64_u64_rem(pos->irq_pos, pos->period_size_frac,
+			              &pos->irq_pos);
+		}
+	} else if (secs) {
+		*elapsed = MINIVOSC_POS_PERIOD | MINIVOSC_POS_CATCHUP;
+	}
+
+	if (count > pos->buffer_frames)
+		count = pos->buffer_frames + do_div(count, pos->buffer_frames);
+	return count;
+}
+
+/*
+ *
+ * Signal generator
+ *
+ */
+#define WVF_SIZE	21 // samples in wvfdat
+#define WVF_LIFTS	4 // the waveform is lifted by 10 on each wrap, 4 times
+
+// largest signal cycle kept as a prerendered image, and the most
+// bytes past the cycle it holds (a whole buffer, if not larger)
+#define MAX_CYCLE_BYTES	(1024 * 1024)
+#define MAX_SPAN_BYTES	(1024 * 1024)
+
+#define MINIVOSC_BLOCK	64 // frames rendered per pass
+#define MINIVOSC_MAX_CHANNELS	32
+
+// oscillator waveforms
+enum {
+	MINIVOSC_WAVE_TABLE,	// wvfdat, lifted on each wrap
+	MINIVOSC_WAVE_SINE,
+	MINIVOSC_WAVE_SQUARE,
+	MINIVOSC_WAVE_SAW,
+	MINIVOSC_WAVE_TRIANGLE,
+};
+
+typedef void (*minivosc_store_t)(const s32 *src, char *dst,
+                        unsigned int frames, unsigned int channels);
+
+// the oscillator of one channel, when the channels differ
+struct minivosc_voice
+{
+	u32 phase;
+	u32 phase_inc;		/* per frame */
+	u32 phase_offset;	/* ch_phase, as a fraction of a turn */
+	s32 gain;		/* Q15 */
+};
+
+/*
+ * generator state of one stream: the oscillator, the store routine
+ * for the stream format, and the prerendered signal image
+ */
+struct minivosc_signal
+{
+	/* stream geometry */
+	unsigned int rate;
+	unsigned int channels;
+	unsigned int frame_bytes;
+	/* phase accumulator (DDS) oscillator: */
+	unsigned int osc_wave;	/* MINIVOSC_WAVE_* */
+	unsigned int osc_freq;	/* in Hz */
+	unsigned int osc_amp;	/* in percent of full scale */
+	int osc_lift;		/* DC offset, in percent of full scale */
+	unsigned int osc_mute;	/* silence, whatever the above */
+	s32 osc_gain;		/* osc_amp as Q15 */
+	s32 osc_dc;		/* osc_lift as Q31 */
+	u32 osc_phase;		/* 2^32 is one turn */
+	u32 osc_phase_inc;	/* per frame */
+	/* per channel oscillators, if osc_voices is set (not for the
+	 * table wave): each channel with its own frequency (0 = osc_freq),
+	 * amplitude (in percent of osc_amp) and phase (in degrees) */
+	unsigned int osc_voices;
+	unsigned int ch_freq[MINIVOSC_MAX_CHANNELS];
+	unsigned int ch_amp[MINIVOSC_MAX_CHANNELS];
+	unsigned int ch_phase[MINIVOSC_MAX_CHANNELS];
+	struct minivosc_voice voice[MINIVOSC_MAX_CHANNELS];
+	unsigned int voices_tuned;	/* voice[] runs: osc_voices when tuned */
+	/* table wave: */
+	unsigned int wvf_pos;	/* position in waveform array */
+	unsigned int wvf_lift;	/* lift of waveform array */
+	minivosc_store_t store;	/* writes Q31 samples in the stream format */
+	minivosc_store_t store_bits;	/* writes 32-bit words as they are */
+	minivosc_store_t store_chan;	/* writes one channel of the frames */
+	/* signal image rendered at prepare: one signal cycle, plus a
+	 * whole PCM buffer (up to MAX_SPAN_BYTES), so a fill is a copy
+	 * from a single offset; NULL if the cycle is too long, or no
+	 * image was asked for, or the oscillator was retuned since -
+	 * then we generate directly */
+	const char *wvf_cache;	/* wvf_cache_buf, or a shared image */
+	char *wvf_cache_buf;	/* the allocation wvf_cache points to */
+	unsigned int wvf_cache_alloc;	/* allocated bytes */
+	unsigned int wvf_cycle_bytes;	/* bytes in one signal cycle */
+	unsigned int wvf_span_bytes;	/* the most to copy at once */
+	unsigned int wvf_cache_pos;	/* byte offset of next frame */
+};
+
+/*
+ * what the signal image depends on: signals with equal keys (compared
+ * with memcmp - the key is zeroed first) render the same image, so
+ * streams may share one, see minivosc_signal_render()
+ */
+struct minivosc_image_key
+{
+	minivosc_store_t store;	/* the format, and mono/stereo/multi */
+	unsigned int channels;
+	unsigned int rate;
+	unsigned int wave;
+	unsigned int hz;	/* if not voiced */
+	unsigned int mute;
+	s32 gain;
+	s32 dc;
+	struct {
+		unsigned int hz;
+		u32 offset;
+		s32 gain;
+	} voice[MINIVOSC_MAX_CHANNELS];	/* if voiced */
+};
+
+// the table wave (the unmodified wvfdat of the driver)
+static const char minivosc_wvf_table[WVF_SIZE] = {
+			20, 22, 24, 25, 24, 22, 21,
+			19, 17, 15, 14, 15, 17, 19,
+			20, 127, 22, 19, 17, 15, 19};
+
+// quarter wave of sine, as Q31 - 256 steps plus the end point,
+// linearly interpolated by minivosc_osc_sine()
+static const u32 minivosc_sine_lut[257] =
+{
+	0x00000000, 0x00c90f88, 0x01921d20, 0x025b26d7, 0x03242abf, 0x03ed26e6,
+	0x04b6195d, 0x057f0035, 0x0647d97c, 0x0710a345, 0x07d95b9e, 0x08a2009a,
+	0x096a9049, 0x0a3308bc, 0x0afb6805, 0x0bc3ac35, 0x0c8bd35e, 0x0d53db92,
+	0x0e1bc2e4, 0x0ee38766, 0x0fab272b, 0x1072a048, 0x1139f0cf, 0x120116d5,
+	0x12c8106e, 0x138edbb1, 0x145576b1, 0x151bdf85, 0x15e21444, 0x16a81305,
+	0x176dd9de, 0x183366e8, 0x18f8b83c, 0x19bdcbf3, 0x1a82a025, 0x1b4732ef,
+	0x1c0b826a, 0x1ccf8cb3, 0x1d934fe5, 0x1e56ca1e, 0x1f19f97b, 0x1fdcdc1b,
+	0x209f701c, 0x2161b39f, 0x2223a4c5, 0x22e541af, 0x23a6887e, 0x24677757,
+	0x25280c5d, 0x25e845b6, 0x26a82185, 0x27679df4, 0x2826b928, 0x28e5714a,
+	0x29a3c485, 0x2a61b101, 0x2b1f34eb, 0x2bdc4e6f, 0x2c98fbba, 0x2d553afb,
+	0x2e110a62, 0x2ecc681e, 0x2f875262, 0x3041c760, 0x30fbc54d, 0x31b54a5d,
+	0x326e54c7, 0x3326e2c2, 0x33def287, 0x3496824f, 0x354d9056, 0x36041ad9,
+	0x36ba2013, 0x376f9e46, 0x382493b0, 0x38d8fe93, 0x398cdd32, 0x3a402dd1,
+	0x3af2eeb7, 0x3ba51e29, 0x3c56ba70, 0x3d07c1d5, 0x3db832a5, 0x3e680b2c,
+	0x3f1749b7, 0x3fc5ec97, 0x4073f21d, 0x4121589a, 0x41ce1e64, 0x427a41d0,
+	0x4325c135, 0x43d09aec, 0x447acd50, 0x452456bc, 0x45cd358f, 0x46756827,
+	0x471cece6, 0x47c3c22e, 0x4869e664, 0x490f57ee, 0x49b41533, 0x4a581c9d,
+	0x4afb6c97, 0x4b9e038f, 0x4c3fdff3, 0x4ce10034, 0x4d8162c3, 0x4e210617,
+	0x4ebfe8a4, 0x4f5e08e2, 0x4ffb654c, 0x5097fc5e, 0x5133cc94, 0x51ced46e,
+	0x5269126e, 0x53028517, 0x539b2aef, 0x5433027d, 0x54ca0a4a, 0x556040e2,
+	0x55f5a4d2, 0x568a34a9, 0x571deef9, 0x57b0d255, 0x5842dd54, 0x58d40e8c,
+	0x59646497, 0x59f3de12, 0x5a827999, 0x5b1035ce, 0x5b9d1153, 0x5c290acc,
+	0x5cb420df, 0x5d3e5236, 0x5dc79d7b, 0x5e50015d, 0x5ed77c89, 0x5f5e0db2,
+	0x5fe3b38d, 0x60686cce, 0x60ec382f, 0x616f146b, 0x61f1003e, 0x6271fa68,
+	0x62f201ac, 0x637114cc, 0x63ef328f, 0x646c59bf, 0x64e88925, 0x6563bf91,
+	0x65ddfbd2, 0x66573cbb, 0x66cf811f, 0x6746c7d7, 0x67bd0fbc, 0x683257aa,
+	0x68a69e80, 0x6919e31f, 0x698c246b, 0x69fd614a, 0x6a6d98a3, 0x6adcc964,
+	0x6b4af278, 0x6bb812d0, 0x6c24295f, 0x6c8f351b, 0x6cf934fb, 0x6d6227f9,
+	0x6dca0d14, 0x6e30e349, 0x6e96a99c, 0x6efb5f11, 0x6f5f02b1, 0x6fc19384,
+	0x70231099, 0x708378fe, 0x70e2cbc5, 0x71410804, 0x719e2cd1, 0x71fa3948,
+	0x72552c84, 0x72af05a6, 0x7307c3cf, 0x735f6625, 0x73b5ebd0, 0x740b53fa,
+	0x745f9dd0, 0x74b2c883, 0x7504d344, 0x7555bd4b, 0x75a585ce, 0x75f42c0a,
+	0x7641af3c, 0x768e0ea5, 0x76d94988, 0x77235f2c, 0x776c4eda, 0x77b417df,
+	0x77fab988, 0x78403328, 0x78848413, 0x78c7aba1, 0x7909a92c, 0x794a7c11,
+	0x798a23b0, 0x79c89f6d, 0x7a05eeac, 0x7a4210d8, 0x7a7d055a, 0x7ab6cba3,
+	0x7aef6323, 0x7b26cb4e, 0x7b5d039d, 0x7b920b88, 0x7bc5e28f, 0x7bf8882f,
+	0x7c29fbed, 0x7c5a3d4f, 0x7c894bdd, 0x7cb72723, 0x7ce3ceb1, 0x7d0f4217,
+	0x7d3980eb, 0x7d628ac5, 0x7d8a5f3f, 0x7db0fdf7, 0x7dd6668e, 0x7dfa98a7,
+	0x7e1d93e9, 0x7e3f57fe, 0x7e5fe492, 0x7e7f3956, 0x7e9d55fb, 0x7eba3a38,
+	0x7ed5e5c5, 0x7ef0585f, 0x7f0991c3, 0x7f2191b3, 0x7f3857f5, 0x7f4de450,
+	0x7f62368e, 0x7f754e7f, 0x7f872bf2, 0x7f97cebc, 0x7fa736b3, 0x7fb563b2,
+	0x7fc25595, 0x7fce0c3d, 0x7fd8878d, 0x7fe1c76a, 0x7fe9cbbf, 0x7ff09477,
+	0x7ff62181, 0x7ffa72d0, 0x7ffd8859, 0x7fff6215, 0x7fffffff,
+};
+
+static inline s32 minivosc_osc_sine(u32 phase)
+{
+	u32 q = phase;
+	unsigned int idx;
+	s32 a, b, v;
+
+	if (phase & 0x40000000) // 2nd and 4th quadrant run backwards
+		q = ~phase;
+	q &= 0x3fffffff;
+	idx = q >> 22;
+	a = minivosc_sine_lut[idx];
+	b = minivosc_sine_lut[idx + 1];
+	v = a + (s32)(((s64)(b - a) * ((q >> 6) & 0xffff)) >> 16);
+	return (phase & 0x80000000) ? -v : v;
+}
+
+static inline s32 minivosc_osc_triangle(u32 phase)
+{
+	s32 r = (s32)((phase << 1) ^ 0x80000000);
+	return (phase & 0x80000000) ? ~r : r;
+}
+
+// render frames of a DDS wave from phase on, as Q31 samples scaled
+// by gain; only one waveform is looked at per call. Returns the phase
+// past them.
+static u32 minivosc_osc_wave(unsigned int wave, u32 phase, u32 inc,
+                        s32 gain, s32 *buf, unsigned int frames)
+{
+	unsigned int i;
+
+#define OSC_LOOP(expr) \
+	for (i = 0; i < frames; i++, phase += inc) \
+		buf[i] = (s32)(((s64)(expr) * gain) >> 15)
+
+	switch (wave) {
+	case MINIVOSC_WAVE_SINE:
+		OSC_LOOP(minivosc_osc_sine(phase));
+		break;
+	case MINIVOSC_WAVE_SQUARE:
+		OSC_LOOP((phase & 0x80000000) ? S32_MIN + 1 : S32_MAX);
+		break;
+	case MINIVOSC_WAVE_SAW:
+		OSC_LOOP((s32)(phase ^ 0x80000000));
+		break;
+	default: // MINIVOSC_WAVE_TRIANGLE
+		OSC_LOOP(minivosc_osc_triangle(phase));
+		break;
+	}
+#undef OSC_LOOP
+	return phase;
+}
+
+static void minivosc_osc_dc(const struct minivosc_signal *sig, s32 *buf,
+                            unsigned int frames)
+{
+	unsigned int i;
+
+	if (sig->osc_dc) { // saturating
+		for (i = 0; i < frames; i++)
+			buf[i] = (s32)clamp_t(s64, (s64)buf[i] + sig->osc_dc,
+			                      S32_MIN + 1, S32_MAX);
+	}
+}
+
+// render frames of the selected wave as Q31 samples, scaled by
+// the amplitude - the same for all channels
+static void minivosc_osc_render(struct minivosc_signal *sig, s32 *buf,
+                        unsigned int frames)
+{
+	s32 gain = sig->osc_gain;
+	unsigned int i;
+
+	switch (sig->osc_wave) {
+	case MINIVOSC_WAVE_TABLE: // walk the lifted wvfdat
+		for (i = 0; i < frames; i++) {
+			s32 v = minivosc_wvf_table[sig->wvf_pos] + sig->wvf_lift*10 - 10;
+			buf[i] = (s32)(((s64)((v - 128) * (1 << 24)) * gain) >> 15);
+			if (++sig->wvf_pos >= WVF_SIZE) { // we should wrap waveform here..
+				sig->wvf_pos = 0;
+				// also handle lift here..
+				if (++sig->wvf_lift >= WVF_LIFTS)
+					sig->wvf_lift = 0;
+			}
+		}
+		break;
+	default:
+		sig->osc_phase = minivosc_osc_wave(sig->osc_wave,
+			sig->osc_phase, sig->osc_phase_inc, gain, buf, frames);
+		break;
+	}
+	minivosc_osc_dc(sig, buf, frames);
+}
+
+// convert a sample given as signed 32-bit fraction (Q31)
+// to the bit pattern of an IEEE754 single - no FPU in the kernel
+static inline u32 minivosc_q31_to_float(s32 x)
+{
+	u32 sign = 0, mag = x;
+	int msb;
+
+	if (!x)
+		return 0;
+	if (x < 0) {
+		sign = 0x80000000;
+		mag = -(u32)x;
+	}
+	msb = fls(mag) - 1; // value is 1.m * 2^(msb - 31)
+	if (msb > 23)
+		mag >>= msb - 23;
+	else
+		mag <<= 23 - msb;
+	return sign | ((u32)(127 + msb - 31) << 23) | (mag & 0x7fffff);
+}
+
+#define MINIVOSC_Q31_TO_U8(x)		((u8)(((x) >> 24) + 128))
+#define MINIVOSC_Q31_TO_S16_LE(x)	((u16)((x) >> 16))
+#define MINIVOSC_Q31_TO_S24_LE(x)	((u32)((x) >> 8))
+#define MINIVOSC_Q31_TO_S32_LE(x)	((u32)(x))
+#define MINIVOSC_Q31_TO_FLOAT_LE(x)	minivosc_q31_to_float(x)
+
+// store routines, one per format and channel layout (mono, stereo,
+// any); they write Q31 samples to the buffer, the same value to all
+// channels, so the format is never looked at per sample. The chan
+// ones write a single channel: dst points to its first sample.
+#define MINIVOSC_DEFINE_STORE(fmt, type)				\
+static void minivosc_store_##fmt##_mono(const s32 *src, char *dst,	\
+                        unsigned int frames,				\
+                        unsigned int channels __maybe_unused)		\
+{									\
+	type *p = (type *)dst;						\
+									\
+	while (frames--)						\
+		*p++ = MINIVOSC_Q31_TO_##fmt(*src++);			\
+}									\
+									\
+static void minivosc_store_##fmt##_stereo(const s32 *src, char *dst,	\
+                        unsigned int frames,				\
+                        unsigned int channels __maybe_unused)		\
+{									\
+	type *p = (type *)dst;						\
+									\
+	while (frames--) {						\
+		type v = MINIVOSC_Q31_TO_##fmt(*src++);			\
+		p[0] = v;						\
+		p[1] = v;						\
+		p += 2;							\
+	}								\
+}									\
+									\
+static void minivosc_store_##fmt##_multi(const s32 *src, char *dst,	\
+                        unsigned int frames, unsigned int channels)	\
+{									\
+	type *p = (type *)dst;						\
+	unsigned int c;							\
+									\
+	while (frames--) {						\
+		type v = MINIVOSC_Q31_TO_##fmt(*src++);			\
+		for (c = 0; c < channels; c++)				\
+			*p++ = v;					\
+	}								\
+}									\
+									\
+static void minivosc_store_##fmt##_chan(const s32 *src, char *dst,	\
+                        unsigned int frames, unsigned int channels)	\
+{									\
+	type *p = (type *)dst;						\
+									\
+	for (; frames; frames--, p += channels)				\
+		*p = MINIVOSC_Q31_TO_##fmt(*src++);			\
+}
+
+MINIVOSC_DEFINE_STORE(U8, u8)
+MINIVOSC_DEFINE_STORE(S16_LE, u16)
+MINIVOSC_DEFINE_STORE(S24_LE, u32)
+MINIVOSC_DEFINE_STORE(S32_LE, u32)
+MINIVOSC_DEFINE_STORE(FLOAT_LE, u32)
+
+#define MINIVOSC_STORE_ENTRY(fmt) \
+	{ minivosc_store_##fmt##_mono, minivosc_store_##fmt##_stereo, \
+	  minivosc_store_##fmt##_multi, minivosc_store_##fmt##_chan }
+
+static const struct {
+	snd_pcm_format_t format;
+	minivosc_store_t store[4];
+} minivosc_store_table[] =
+{
+	{ SNDRV_PCM_FORMAT_U8, MINIVOSC_STORE_ENTRY(U8) },
+	{ SNDRV_PCM_FORMAT_S16_LE, MINIVOSC_STORE_ENTRY(S16_LE) },
+	{ SNDRV_PCM_FORMAT_S24_LE, MINIVOSC_STORE_ENTRY(S24_LE) },
+	{ SNDRV_PCM_FORMAT_S32_LE, MINIVOSC_STORE_ENTRY(S32_LE) },
+	{ SNDRV_PCM_FORMAT_FLOAT_LE, MINIVOSC_STORE_ENTRY(FLOAT_LE) },
+};
+
+static minivosc_store_t minivosc_store_find(snd_pcm_format_t format,
+                                            unsigned int channels)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(minivosc_store_table); i++)
+		if (minivosc_store_table[i].format == format)
+			return minivosc_store_table[i].store[
+				channels > 2 ? 2 : channels - 1];
+	return NULL;
+}
+
+static minivosc_store_t minivosc_store_chan_find(snd_pcm_format_t format)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(minivosc_store_table); i++)
+		if (minivosc_store_table[i].format == format)
+			return minivosc_store_table[i].store[3];
+	return NULL;
+}
+
+typedef void (*minivosc_gen_t)(struct minivosc_signal *sig, char *dst,
+                        unsigned int bytes);
+
+static inline bool minivosc_signal_voiced(const struct minivosc_signal *sig)
+{
+	return sig->osc_voices && sig->osc_wave != MINIVOSC_WAVE_TABLE;
+}
+
+// per channel oscillators: a block of each channel in turn, rendered
+// in one go and stored to its place in the interleaved frames - the
+// frames of a block stay in the cache until all channels are in
+static void minivosc_fill_voices(struct minivosc_signal *sig, char *dst,
+                        unsigned int frames)
+{
+	unsigned int sample_bytes = sig->frame_bytes / sig->channels;
+	s32 buf[MINIVOSC_BLOCK];
+	unsigned int n, c;
+
+	while (frames) {
+		n = min_t(unsigned int, frames, MINIVOSC_BLOCK);
+		for (c = 0; c < sig->channels; c++) {
+			struct minivosc_voice *v = &sig->voice[c];
+
+			v->phase = minivosc_osc_wave(sig->osc_wave, v->phase,
+				v->phase_inc, v->gain, buf, n);
+			minivosc_osc_dc(sig, buf, n);
+			sig->store_chan(buf, dst + c * sample_bytes, n,
+			                sig->channels);
+		}
+		dst += n * sig->frame_bytes;
+		frames -= n;
+	}
+}
+
+// generate frames straight into the buffer (no wrap handling here)
+static void minivosc_fill_frames(struct minivosc_signal *sig, char *dst,
+                        unsigned int frames)
+{
+	s32 buf[MINIVOSC_BLOCK];
+
+	if (minivosc_signal_voiced(sig)) {
+		minivosc_fill_voices(sig, dst, frames);
+		return;
+	}
+	while (frames) {
+		unsigned int n = min_t(unsigned int, frames, MINIVOSC_BLOCK);
+
+		minivosc_osc_render(sig, buf, n);
+		sig->store(buf, dst, n, sig->channels);
+		dst += n * sig->frame_bytes;
+		frames -= n;
+	}
+}
+
+static void minivosc_signal_free(struct minivosc_signal *sig)
+{
+	vfree(sig->wvf_cache_buf);
+	sig->wvf_cache = NULL;
+	sig->wvf_cache_buf = NULL;
+	sig->wvf_cache_alloc = 0;
+}
+
+// the oscillator frequency: below Nyquist
+static inline unsigned int minivosc_signal_hz(const struct minivosc_signal *sig)
+{
+	return clamp_t(unsigned int, sig->osc_freq, 1, sig->rate / 2);
+}
+
+// the frequency of channel c, if voiced
+static inline unsigned int minivosc_voice_hz(const struct minivosc_signal *sig,
+                                             unsigned int c)
+{
+	return clamp_t(unsigned int, sig->ch_freq[c] ? sig->ch_freq[c] :
+	               sig->osc_freq, 1, sig->rate / 2);
+}
+
+// the frame at which the signal first repeats exactly; more than
+// limit frames: limit + 1
+static unsigned int minivosc_signal_cycle(const struct minivosc_signal *sig,
+                                          unsigned int limit)
+{
+	unsigned int c, n;
+	u64 cycle;
+
+	if (sig->osc_wave == MINIVOSC_WAVE_TABLE)
+		return WVF_LIFTS * WVF_SIZE;
+	if (!minivosc_signal_voiced(sig))
+		return sig->rate / gcd(minivosc_signal_hz(sig), sig->rate);
+	// the least common multiple of the cycles of all channels
+	for (c = 0, cycle = 1; c < sig->channels; c++) {
+		n = sig->rate / gcd(minivosc_voice_hz(sig, c), sig->rate);
+		cycle = cycle / gcd(cycle, n) * n;
+		if (cycle > limit)
+			return limit + 1;
+	}
+	return cycle;
+}
+
+// the oscillator from osc_wave, osc_freq, osc_amp, osc_lift and
+// osc_mute (and the ch_* of each channel, if voiced); the phase goes
+// on where it is
+static void minivosc_signal_tune(struct minivosc_signal *sig)
+{
+	unsigned int c;
+
+	if (sig->osc_mute) {
+		sig->osc_gain = 0;
+		sig->osc_dc = 0;
+	} else {
+		sig->osc_gain = clamp_t(unsigned int, sig->osc_amp, 0, 100) *
+			32768 / 100;
+		sig->osc_dc = clamp_t(int, sig->osc_lift, -100, 100) *
+			(S32_MAX / 100);
+	}
+	sig->osc_phase_inc = (u32)div_u64((u64)minivosc_signal_hz(sig) << 32,
+	                                  sig->rate);
+	if (!sig->osc_voices) {
+		// back to one oscillator: on from where the first one is
+		if (sig->voices_tuned)
+			sig->osc_phase = sig->voice[0].phase -
+				sig->voice[0].phase_offset;
+		sig->voices_tuned = 0;
+		return;
+	}
+	for (c = 0; c < sig->channels; c++) {
+		struct minivosc_voice *v = &sig->voice[c];
+		u32 offset = (u32)div_u64((u64)(sig->ch_phase[c] % 360) << 32,
+		                          360);
+
+		v->gain = sig->osc_gain *
+			(s32)min_t(unsigned int, sig->ch_amp[c], 100) / 100;
+		v->phase_inc = (u32)div_u64((u64)minivosc_voice_hz(sig, c) << 32,
+		                            sig->rate);
+		// a new phase offset shifts the phase by the difference
+		if (sig->voices_tuned)
+			v->phase += offset - v->phase_offset;
+		else
+			v->phase = sig->osc_phase + offset;
+		v->phase_offset = offset;
+	}
+	sig->voices_tuned = 1;
+}
+
+// the exact phase of frame n (from the start) at hz
+static inline u32 minivosc_phase_at(unsigned int n, unsigned int hz,
+                                    unsigned int rate)
+{
+	u32 rem;
+
+	div_u64_rem((u64)n * hz, rate, &rem);
+	return (u32)div_u64((u64)rem << 32, rate);
+}
+
+// stop using the image, with the oscillator where the image is: e.g.
+// before retuning, as the image is of the old signal
+static void __maybe_unused minivosc_signal_live(struct minivosc_signal *sig)
+{
+	unsigned int n, c;
+
+	if (!sig->wvf_cache)
+		return;
+	n = sig->wvf_cache_pos / sig->frame_bytes; // frames into the cycle
+	if (sig->osc_wave == MINIVOSC_WAVE_TABLE) {
+		sig->wvf_lift = n / WVF_SIZE;
+		sig->wvf_pos = n % WVF_SIZE;
+	} else if (minivosc_signal_voiced(sig)) {
+		for (c = 0; c < sig->channels; c++)
+			sig->voice[c].phase = sig->voice[c].phase_offset +
+				minivosc_phase_at(n, minivosc_voice_hz(sig, c),
+				                  sig->rate);
+	} else {
+		// the exact phase the image was rendered with
+		sig->osc_phase = minivosc_phase_at(n, minivosc_signal_hz(sig),
+		                                   sig->rate);
+	}
+	sig->wvf_cache = NULL;
+}
+
+// back to the start of the signal
+static void minivosc_signal_rewind(struct minivosc_signal *sig)
+{
+	unsigned int c;
+
+	sig->osc_phase = 0;
+	sig->wvf_pos = 0;
+	sig->wvf_lift = 0;
+	for (c = 0; c < sig->channels; c++)
+		sig->voice[c].phase = sig->voice[c].phase_offset;
+}
+
+// renders the image of a signal set up by minivosc_signal_setup()
+// (with or without one) into dst, size bytes of it - a cycle, then
+// the cycle over again; the oscillator is back at the start after
+static void minivosc_signal_render(struct minivosc_signal *sig, char *dst,
+                                   unsigned int size)
+{
+	unsigned int frame_bytes = sig->frame_bytes, rate = sig->rate;
+	unsigned int cycle = sig->wvf_cycle_bytes / frame_bytes;
+	unsigned int hz = minivosc_signal_hz(sig), num, n, i, c;
+
+	minivosc_signal_rewind(sig);
+	if (sig->osc_wave == MINIVOSC_WAVE_TABLE) {
+		minivosc_fill_frames(sig, dst, cycle);
+	} else if (minivosc_signal_voiced(sig)) {
+		// as below, for each channel
+		for (n = 0; n < cycle; n++) {
+			for (c = 0; c < sig->channels; c++)
+				sig->voice[c].phase = sig->voice[c].phase_offset +
+					minivosc_phase_at(n, minivosc_voice_hz(sig, c),
+					                  rate);
+			minivosc_fill_frames(sig, dst + n * frame_bytes, 1);
+		}
+	} else {
+		// use the exact phase of each frame, (n * freq / rate) of
+		// a turn, so the image wraps without any phase error
+		for (n = 0, num = 0; n < cycle; n++) {
+			sig->osc_phase = (u32)div_u64((u64)num << 32, rate);
+			minivosc_fill_frames(sig, dst + n * frame_bytes, 1);
+			num += hz;
+			if (num >= rate)
+				num -= rate;
+		}
+	}
+	// the rest of the image just repeats the cycle
+	for (n = sig->wvf_cycle_bytes; n < size; n += i) {
+		i = min(size - n, n);
+		memcpy(dst + n, dst, i);
+	}
+	minivosc_signal_rewind(sig);
+}
+
+// the bytes of the image of a set up signal: a cycle, and the most a
+// fill copies at once past it; 0 if the cycle is too long for one
+static inline unsigned int minivosc_signal_image_bytes(const struct minivosc_signal *sig)
+{
+	if (sig->wvf_cycle_bytes > MAX_CYCLE_BYTES)
+		return 0;
+	return sig->wvf_cycle_bytes + sig->wvf_span_bytes;
+}
+
+// the key of the image of a set up signal
+static void __maybe_unused minivosc_signal_key(const struct minivosc_signal *sig,
+                                struct minivosc_image_key *key)
+{
+	unsigned int c;
+
+	memset(key, 0, sizeof(*key));
+	key->store = sig->store;
+	key->channels = sig->channels;
+	key->rate = sig->rate;
+	key->wave = sig->osc_wave;
+	key->mute = sig->osc_mute;
+	key->gain = sig->osc_gain;
+	key->dc = sig->osc_dc;
+	if (!minivosc_signal_voiced(sig)) {
+		key->hz = minivosc_signal_hz(sig);
+		return;
+	}
+	for (c = 0; c < sig->channels; c++) {
+		key->voice[c].hz = minivosc_voice_hz(sig, c);
+		key->voice[c].offset = sig->voice[c].phase_offset;
+		key->voice[c].gain = sig->voice[c].gain;
+	}
+}
+
+// have a set up signal copy from an image rendered elsewhere (of the
+// same key, and at least minivosc_signal_image_bytes()); it stays the
+// caller's, and is only read
+static inline void minivosc_signal_use(struct minivosc_signal *sig,
+                                       const char *image)
+{
+	sig->wvf_cache = image;
+	sig->wvf_cache_pos = 0;
+}
+
+// called at prepare: choose the store routine for the stream format,
+// set up the oscillator, and - if an image is wanted and the signal
+// repeats exactly after a reasonable number of frames - render the
+// waveform image that the fills copy from (into a buffer of its own;
+// or see minivosc_signal_use).
+// osc_wave, osc_freq and osc_amp (and the ch_* if osc_voices) are to
+// be set by the caller.
+static int minivosc_signal_setup(struct minivosc_signal *sig,
+                        snd_pcm_format_t format, unsigned int channels,
+                        unsigned int rate, unsigned int buffer_bytes,
+                        bool image)
+{
+	unsigned int frame_bytes, cycle, size;
+
+	sig->store = minivosc_store_find(format, channels);
+	if (!sig->store || channels > MINIVOSC_MAX_CHANNELS)
+		return -EINVAL;
+	sig->store_bits = minivosc_store_find(SNDRV_PCM_FORMAT_S32_LE, channels);
+	sig->store_chan = minivosc_store_chan_find(format);
+	sig->rate = rate;
+	sig->channels = channels;
+	frame_bytes = (format == SNDRV_PCM_FORMAT_U8 ? 1 :
+	               format == SNDRV_PCM_FORMAT_S16_LE ? 2 : 4) * channels;
+	sig->frame_bytes = frame_bytes;
+
+	minivosc_signal_tune(sig);
+	minivosc_signal_rewind(sig);
+
+	// frames after which the signal repeats exactly
+	cycle = minivosc_signal_cycle(sig, MAX_CYCLE_BYTES / frame_bytes);
+
+	sig->wvf_cache = NULL;
+	sig->wvf_cache_pos = 0;
+	sig->wvf_cycle_bytes = cycle * frame_bytes;
+	// past the cycle, a whole buffer - or as much of it as
+	// MAX_SPAN_BYTES allows; larger fills take more than one copy
+	sig->wvf_span_bytes = min_t(unsigned int, buffer_bytes,
+		MAX_SPAN_BYTES / frame_bytes * frame_bytes);
+	size = minivosc_signal_image_bytes(sig);
+	if (!size || !image) {
+		// no image - the fills generate directly
+		minivosc_signal_free(sig);
+		return 0;
+	}
+
+	if (size > sig->wvf_cache_alloc) {
+		minivosc_signal_free(sig);
+		sig->wvf_cache_buf = vmalloc(size);
+		if (!sig->wvf_cache_buf)
+			return -ENOMEM;
+		sig->wvf_cache_alloc = size;
+	}
+	minivosc_signal_render(sig, sig->wvf_cache_buf, size);
+	sig->wvf_cache = sig->wvf_cache_buf;
+	return 0;
+}
+
+// the next bytes of the signal, to dst: copies from the signal image,
+// MAX_SPAN_BYTES at a time, or runs the oscillator if there is none
+static void minivosc_gen(struct minivosc_signal *sig, char *dst,
+                         unsigned int bytes)
+{
+	unsigned int size;
+
+	if (!sig->wvf_cache) {
+		minivosc_fill_frames(sig, dst, bytes / sig->frame_bytes);
+		return;
+	}
+	while (bytes) {
+		size = min(bytes, sig->wvf_span_bytes);
+		memcpy(dst, sig->wvf_cache + sig->wvf_cache_pos, size);
+		sig->wvf_cache_pos = (sig->wvf_cache_pos + size) %
+			sig->wvf_cycle_bytes;
+		dst += size;
+		bytes -= size;
+	}
+}
+
+// as minivosc_gen, but by unsigned long words in a plain loop - no
+// call, which may win for the short copies of small periods
+static void minivosc_gen_words(struct minivosc_signal *sig, char *dst,
+                               unsigned int bytes)
+{
+	const char *src;
+	unsigned int size;
+
+	if (!sig->wvf_cache) {
+		minivosc_gen(sig, dst, bytes);
+		return;
+	}
+	while (bytes) {
+		size = min(bytes, sig->wvf_span_bytes);
+		src = sig->wvf_cache + sig->wvf_cache_pos;
+		sig->wvf_cache_pos = (sig->wvf_cache_pos + size) %
+			sig->wvf_cycle_bytes;
+		bytes -= size;
+		for (; size >= sizeof(unsigned long); size -= sizeof(unsigned long)) {
+			put_unaligned(get_unaligned((const unsigned long *)src),
+			              (unsigned long *)dst);
+			src += sizeof(unsigned long);
+			dst += sizeof(unsigned long);
+		}
+		while (size--)
+			*dst++ = *src++;
+	}
+}
+
+// moves the signal on by bytes, without generating them
+static void minivosc_signal_skip(struct minivosc_signal *sig,
+                                 unsigned int bytes)
+{
+	unsigned int frames = bytes / sig->frame_bytes, c;
+
+	if (sig->wvf_cache) {
+		sig->wvf_cache_pos = (sig->wvf_cache_pos + bytes) %
+			sig->wvf_cycle_bytes;
+	} else if (sig->osc_wave == MINIVOSC_WAVE_TABLE) {
+		frames = (sig->wvf_lift * WVF_SIZE + sig->wvf_pos + frames) %
+			(WVF_LIFTS * WVF_SIZE);
+		sig->wvf_lift = frames / WVF_SIZE;
+		sig->wvf_pos = frames % WVF_SIZE;
+	} else if (minivosc_signal_voiced(sig)) {
+		for (c = 0; c < sig->channels; c++)
+			sig->voice[c].phase += frames * sig->voice[c].phase_inc;
+	} else {
+		sig->osc_phase += frames * sig->osc_phase_inc;
+	}
+}
+
+// bytes of the signal into the ring buffer area at off, by gen
+// (contiguous); returns the offset past them. More than a buffer
+// means a late timer - the oldest part would be overwritten anyway.
+static unsigned int minivosc_signal_ring(struct minivosc_signal *sig,
+                        char *area, unsigned int buffer_bytes,
+                        unsigned int off, unsigned int bytes,
+                        minivosc_gen_t gen)
+{
+	if (bytes > buffer_bytes) {
+		unsigned int skip = bytes - buffer_bytes;
+
+		minivosc_signal_skip(sig, skip);
+		off = (off + skip) % buffer_bytes;
+		bytes -= skip;
+	}
+	// one call, plus one more if the buffer wraps
+	while (bytes) {
+		unsigned int size = bytes;
+		if (off + size > buffer_bytes)
+			size = buffer_bytes - off;
+
+		gen(sig, area + off, size);
+		bytes -= size;
+		off = (off + size) % buffer_bytes;
+	}
+	return off;
+}
+
+/*
+ *
+ * Lazy generation (mmap)
+ *
+ */
+// in the frame counts of the PCM core (hw_ptr, appl_ptr), which wrap at
+// boundary, a multiple of the buffer size: the frames to generate for
+// the buffer to hold everything up to frame target, when it holds
+// everything up to done - none if target is not past done, and no more
+// than a buffer (the older ones would be overwritten right away)
+static inline unsigned long minivosc_lazy_window(unsigned long done,
+                        unsigned long target, unsigned long buffer,
+                        unsigned long boundary)
+{
+	unsigned long frames = (target + boundary - done) % boundary;
+
+	if (frames >= boundary / 2)
+		return 0;
+	return min(frames, buffer);
+}
+
+// where the timer generates up to, for a reader that may not tell us
+// what it has read (mmap, without ack): a period past the position hw -
+// but not over what the reader, at appl, has yet to read
+static inline unsigned long minivosc_lazy_target(unsigned long hw,
+                        unsigned long appl, unsigned long period,
+                        unsigned long buffer, unsigned long boundary)
+{
+	unsigned long target = (hw + period) % boundary;
+	unsigned long limit = (appl + buffer) % boundary;
+
+	if (minivosc_lazy_window(limit, target, buffer, boundary))
+		return limit;
+	return target;
+}
+
+/*
+ *
+ * Latency probe
+ *
+ */
+// every interval frames, a record of where and when in the stream we
+// are replaces the signal - in one channel, or in all of the frame
+// (then it takes fewer frames). Raw bytes, whatever the format:
+//   le32 MINIVOSC_PROBE_MAGIC
+//   le64 index of the first frame of the record, from the start
+//   le64 CLOCK_MONOTONIC ns at which that frame became captured
+// the last slot of a record is zero padded
+#define MINIVOSC_PROBE_MAGIC	0x5250564d // "MVPR"
+#define MINIVOSC_PROBE_BYTES	20
+
+struct minivosc_probe
+{
+	unsigned int interval;	/* frames from record to record; 0 = off */
+	unsigned int slot_offset;	/* of the record bytes in a frame */
+	unsigned int slot_bytes;	/* record bytes per frame */
+	unsigned int record_frames;	/* frames per record */
+	unsigned int frame_bytes;
+	unsigned int rate;
+};
+
+// channel < 0 (or past the last one): whole frames
+static void __maybe_unused minivosc_probe_setup(struct minivosc_probe *pr,
+                        unsigned int interval, int channel,
+                        unsigned int channels, unsigned int frame_bytes,
+                        unsigned int rate)
+{
+	pr->frame_bytes = frame_bytes;
+	pr->rate = rate;
+	if (channel < 0 || (unsigned int)channel >= channels) {
+		pr->slot_offset = 0;
+		pr->slot_bytes = frame_bytes;
+	} else {
+		pr->slot_bytes = frame_bytes / channels;
+		pr->slot_offset = channel * pr->slot_bytes;
+	}
+	pr->record_frames = (MINIVOSC_PROBE_BYTES + pr->slot_bytes - 1) /
+		pr->slot_bytes;
+	pr->interval = interval ? max(interval, pr->record_frames) : 0;
+}
+
+static void minivosc_probe_record(u8 *rec, u64 frame, u64 ns)
+{
+	u64 magic = MINIVOSC_PROBE_MAGIC;
+	unsigned int i;
+
+	for (i = 0; i < 4; i++, magic >>= 8)
+		rec[i] = (u8)magic;
+	for (i = 4; i < 12; i++, frame >>= 8)
+		rec[i] = (u8)frame;
+	for (i = 12; i < 20; i++, ns >>= 8)
+		rec[i] = (u8)ns;
+}
+
+// marks the frames just filled - the last frames of the bytes at off
+// in the ring buffer area, which end at frame end (behind or ahead of
+// the current position pos, at time now_ns). Frame f is complete when
+// the position reaches f + 1: ((pos->frames - f - 1) frames + the
+// fraction in irq_pos) ago, or ((f + 1 - pos->frames) frames - that
+// fraction) from now, if filled ahead.
+static void __maybe_unused minivosc_probe_mark(const struct minivosc_probe *pr,
+                        const struct minivosc_pos *pos, u64 end, u64 now_ns,
+                        char *area, unsigned int buffer_bytes,
+                        unsigned int off, unsigned int bytes)
+{
+	unsigned int frames = bytes / pr->frame_bytes;
+	unsigned int buffer_frames = buffer_bytes / pr->frame_bytes;
+	unsigned int j, n, step;
+	u8 rec[MINIVOSC_PROBE_BYTES];
+	u64 f, ns, start = (u64)-1;
+	u32 frac;
+
+	div_u64_rem(pos->irq_pos, NSEC_PER_SEC, &frac);
+	if (frames > buffer_frames) { // only the last buffer was written
+		off = (off + (frames - buffer_frames) * pr->frame_bytes) %
+			buffer_bytes;
+		frames = buffer_frames;
+	}
+	for (f = end - frames; f < end; f += step) {
+		div_u64_rem(f, pr->interval, &j);
+		if (j >= pr->record_frames) {
+			step = min_t(u64, pr->interval - j, end - f);
+		} else {
+			if (start != f - j) {
+				start = f - j;
+				if (start < pos->frames)
+					ns = now_ns - div_u64((pos->frames -
+						start - 1) * NSEC_PER_SEC +
+						frac, pr->rate);
+				else
+					ns = now_ns + div_u64((start + 1 -
+						pos->frames) * NSEC_PER_SEC -
+						frac + pr->rate - 1, pr->rate);
+				minivosc_probe_record(rec, start, ns);
+			}
+			n = min(pr->slot_bytes, MINIVOSC_PROBE_BYTES - j * pr->slot_bytes);
+			memcpy(area + off + pr->slot_offset, rec + j * pr->slot_bytes, n);
+			memset(area + off + pr->slot_offset + n, 0, pr->slot_bytes - n);
+			step = 1;
+		}
+		off = (off + step * pr->frame_bytes) % buffer_bytes;
+	}
+}
+
+/*
+ *
+ * Injection ring consumer
+ *
+ */
+// the driver side of a ring of minivosc_inject.h: ctl and data are
+// shared with the producer, so nothing read from there is trusted
+// beyond staying inside the ring
+struct minivosc_inject
+{
+	struct minivosc_inject_ctl *ctl;
+	char *data;
+	u32 mask;		/* data bytes - 1 */
+	u32 rd;			/* bytes read; ctl->tail is a copy */
+	u32 history;		/* of the bytes read, those still in the ring */
+	u32 loop;		/* repeat: next byte of the history to replay */
+	unsigned int underrun;	/* MINIVOSC_INJECT_UNDERRUN_* */
+};
+
+static void __maybe_unused minivosc_inject_init(struct minivosc_inject *inj,
+                        struct minivosc_inject_ctl *ctl, char *data,
+                        u32 size, unsigned int underrun)
+{
+	memset(inj, 0, sizeof(*inj));
+	inj->ctl = ctl;
+	inj->data = data;
+	inj->mask = size - 1;
+	inj->underrun = underrun;
+	ctl->size = size;
+}
+
+// n bytes of the ring from byte pos on, into the ring buffer area at
+// off; returns the offset past them
+static unsigned int minivosc_inject_copy(const struct minivosc_inject *inj,
+                        u32 pos, char *area, unsigned int buffer_bytes,
+                        unsigned int off, unsigned int n)
+{
+	while (n) {
+		u32 src = pos & inj->mask;
+		unsigned int size = min3(n, inj->mask + 1 - src,
+		                         buffer_bytes - off);
+
+		memcpy(area + off, inj->data + src, size);
+		pos += size;
+		n -= size;
+		off = (off + size) % buffer_bytes;
+	}
+	return off;
+}
+
+// n bytes read (or dropped); a repeat starts over from the oldest
+// byte of the history then
+static void minivosc_inject_consume(struct minivosc_inject *inj, u32 n,
+                                    unsigned int frame_bytes)
+{
+	u32 max_history = inj->mask + 1 - (inj->mask + 1) % frame_bytes;
+
+	if (!n)
+		return;
+	inj->rd += n;
+	inj->history = min(inj->history + n, max_history);
+	inj->loop = 0;
+}
+
+// bytes (whole frames) of the ring buffer area at off, from the ring,
+// copied once - straight from the shared data. What the ring falls
+// short of is made up for as inj->underrun says: silence bytes, the
+// history over again, or the signal sig. More than a buffer means a
+// late timer (as in minivosc_signal_ring): the data that does not
+// fit was due nonetheless, and is dropped.
+// Returns the bytes taken from the ring.
+static unsigned int __maybe_unused minivosc_inject_drain(struct minivosc_inject *inj,
+                        struct minivosc_signal *sig, u8 silence,
+                        char *area, unsigned int buffer_bytes,
+                        unsigned int off, unsigned int bytes)
+{
+	struct minivosc_inject_ctl *ctl = inj->ctl;
+	unsigned int frame_bytes = sig->frame_bytes;
+	u32 avail, n, taken;
+
+	avail = ACCESS_ONCE(ctl->head) - inj->rd;
+	smp_rmb(); // no data read before head
+	if (avail > inj->mask + 1) {
+		// the producer overran us: the oldest data is gone
+		n = avail - (inj->mask + 1);
+		n += (frame_bytes - n % frame_bytes) % frame_bytes;
+		inj->rd += n;
+		avail -= n;
+	}
+	avail -= avail % frame_bytes;
+
+	if (bytes > buffer_bytes) {
+		n = bytes - buffer_bytes;
+		off = (off + n) % buffer_bytes;
+		bytes = buffer_bytes;
+		n = min(n, avail);
+		minivosc_inject_consume(inj, n, frame_bytes);
+		avail -= n;
+	}
+	taken = n = min(avail, bytes);
+	off = minivosc_inject_copy(inj, inj->rd, area, buffer_bytes, off, n);
+	minivosc_inject_consume(inj, n, frame_bytes);
+	bytes -= n;
+
+	if (bytes) {
+		ACCESS_ONCE(ctl->underruns) = ctl->underruns + 1;
+		if (inj->underrun == MINIVOSC_INJECT_UNDERRUN_OSC) {
+			minivosc_signal_ring(sig, area, buffer_bytes, off,
+			                     bytes, minivosc_gen);
+		} else if (inj->underrun == MINIVOSC_INJECT_UNDERRUN_REPEAT &&
+		           inj->history) {
+			while (bytes) {
+				n = min(bytes, inj->history - inj->loop);
+				off = minivosc_inject_copy(inj,
+					inj->rd - inj->history + inj->loop,
+					area, buffer_bytes, off, n);
+				inj->loop = (inj->loop + n) % inj->history;
+				bytes -= n;
+			}
+		} else {
+			while (bytes) {
+				n = min(bytes, buffer_bytes - off);
+				memset(area + off, silence, n);
+				off = (off + n) % buffer_bytes;
+				bytes -= n;
+			}
+		}
+	}
+
+	smp_mb(); // the data is read before the producer may reuse it
+	ACCESS_ONCE(ctl->tail) = inj->rd;
+	return taken;
+}
+
+#endif /* MINIVOSC_CORE_H */
@@ -0,0 +1,68 @@
+/*
+ *  Minimal virtual oscillator (minivosc) soundcard - injection ring
+ *
+ *  The interface to userspace of the hwdep devices of a card
+ *  (/dev/snd/hwC<card>D<N>, one per PCM device N), shared by the
+ *  driver and the producers: a capture subdevice can be fed from a
+ *  ring buffer that a userspace producer writes into, instead of from
+ *  the oscillator.
+ *
+ *  MINIVOSC_IOCTL_INJECT_SETUP attaches a ring to a subdevice, and
+ *  tells where to mmap() it: the first page is a struct
+ *  minivosc_inject_ctl, the data starts at its data_offset. The ring
+ *  has a single producer and a single consumer (the capture fill),
+ *  and no locks:
+ *   - the producer writes whole frames of the capture format at
+ *     head % size, then moves head on (after a write barrier)
+ *   - the driver copies them straight into the capture buffer, then
+ *     moves tail on; head - tail never exceeds size, or the oldest
+ *     data is dropped
+ *  head and tail count bytes, and wrap around at 2^32. When the ring
+ *  runs dry, the capture gets what the underrun policy says. The ring
+ *  goes when the file it was set up through is closed, or at
+ *  MINIVOSC_IOCTL_INJECT_DETACH (a mapping of it stays valid).
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ */
+
+#ifndef MINIVOSC_INJECT_H
+#define MINIVOSC_INJECT_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// what the capture gets while the ring is empty
+#define MINIVOSC_INJECT_UNDERRUN_SILENCE	0
+#define MINIVOSC_INJECT_UNDERRUN_REPEAT	1 // the last ring full read, over again
+#define MINIVOSC_INJECT_UNDERRUN_OSC	2 // the oscillator, as without a ring
+
+#define MINIVOSC_INJECT_MIN_BYTES	4096
+#define MINIVOSC_INJECT_MAX_BYTES	(16 * 1024 * 1024)
+// mmap offset of the ring of subdevice n: n * MINIVOSC_INJECT_STRIDE
+#define MINIVOSC_INJECT_STRIDE	(2 * MINIVOSC_INJECT_MAX_BYTES)
+
+struct minivosc_inject_ctl
+{
+	__u32 head;		/* bytes written; moved by the producer */
+	__u32 tail;		/* bytes read; moved by the driver */
+	__u32 size;		/* data bytes, a power of two */
+	__u32 data_offset;	/* of the data, from the start of the mapping */
+	__u32 underruns;	/* fills the ring fell short of */
+};
+
+struct minivosc_inject_setup
+{
+	__u32 subdevice;	/* capture subdevice to feed */
+	__u32 bytes;		/* data bytes; rounded up to a power of two */
+	__u32 underrun;		/* MINIVOSC_INJECT_UNDERRUN_* */
+	__u32 offset;		/* out: mmap offset of the ring */
+};
+
+#define MINIVOSC_IOCTL_INJECT_SETUP	_IOWR('H', 0xa0, struct minivosc_inject_setup)
+#define MINIVOSC_IOCTL_INJECT_DETACH	_IOW('H', 0xa1, __u32) // subdevice
+
+#endif /* MINIVOSC_INJECT_H */
@@ -0,0 +1,132 @@
+/*
+ *  Minimal virtual oscillator (minivosc) soundcard - tracepoints
+ *
+ *  Use with ftrace/perf, e.g.:
+ *    echo 1 > /sys/kernel/debug/tracing/events/minivosc/enable
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM minivosc
+
+#if !defined(_MINIVOSC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MINIVOSC_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <sound/core.h>
+#include <sound/pcm.h>
+
+// one shared timer callback: streams whose period ended, and how
+// many of them got snd_pcm_period_elapsed() in the batch
+TRACE_EVENT(minivosc_timer,
+	TP_PROTO(int cpu, unsigned int due, unsigned int batch),
+	TP_ARGS(cpu, due, batch),
+	TP_STRUCT__entry(
+		__field(int, cpu)
+		__field(unsigned int, due)
+		__field(unsigned int, batch)
+	),
+	TP_fast_assign(
+		__entry->cpu = cpu;
+		__entry->due = due;
+		__entry->batch = batch;
+	),
+	TP_printk("cpu=%d due=%u batch=%u",
+		__entry->cpu, __entry->due, __entry->batch)
+);
+
+TRACE_EVENT(minivosc_pos_update,
+	TP_PROTO(struct snd_pcm_substream *ss, s64 delta, u64 frames),
+	TP_ARGS(ss, delta, frames),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(int, device)
+		__field(int, subdevice)
+		__field(s64, delta)
+		__field(u64, frames)
+	),
+	TP_fast_assign(
+		__entry->card = ss->pcm->card->number;
+		__entry->device = ss->pcm->device;
+		__entry->subdevice = ss->number;
+		__entry->delta = delta;
+		__entry->frames = frames;
+	),
+	TP_printk("pcmC%dD%dc:%d delta=%lldns frames=%llu",
+		__entry->card, __entry->device, __entry->subdevice,
+		(long long)__entry->delta, (unsigned long long)__entry->frames)
+);
+
+TRACE_EVENT(minivosc_fill_start,
+	TP_PROTO(struct snd_pcm_substream *ss, unsigned int buf_pos,
+		unsigned int bytes),
+	TP_ARGS(ss, buf_pos, bytes),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(int, device)
+		__field(int, subdevice)
+		__field(unsigned int, buf_pos)
+		__field(unsigned int, bytes)
+	),
+	TP_fast_assign(
+		__entry->card = ss->pcm->card->number;
+		__entry->device = ss->pcm->device;
+		__entry->subdevice = ss->number;
+		__entry->buf_pos = buf_pos;
+		__entry->bytes = bytes;
+	),
+	TP_printk("pcmC%dD%dc:%d buf_pos=%u bytes=%u",
+		__entry->card, __entry->device, __entry->subdevice,
+		__entry->buf_pos, __entry->bytes)
+);
+
+TRACE_EVENT(minivosc_fill_end,
+	TP_PROTO(struct snd_pcm_substream *ss, unsigned int bytes),
+	TP_ARGS(ss, bytes),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(int, device)
+		__field(int, subdevice)
+		__field(unsigned int, bytes)
+	),
+	TP_fast_assign(
+		__entry->card = ss->pcm->card->number;
+		__entry->device = ss->pcm->device;
+		__entry->subdevice = ss->number;
+		__entry->bytes = bytes;
+	),
+	TP_printk("pcmC%dD%dc:%d bytes=%u",
+		__entry->card, __entry->device, __entry->subdevice,
+		__entry->bytes)
+);
+
+TRACE_EVENT(minivosc_period_elapsed,
+	TP_PROTO(struct snd_pcm_substream *ss),
+	TP_ARGS(ss),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(int, device)
+		__field(int, subdevice)
+	),
+	TP_fast_assign(
+		__entry->card = ss->pcm->card->number;
+		__entry->device = ss->pcm->device;
+		__entry->subdevice = ss->number;
+	),
+	TP_printk("pcmC%dD%dc:%d",
+		__entry->card, __entry->device, __entry->subdevice)
+);
+
+#endif /* _MINIVOSC_TRACE_H */
+
+// define_trace.h includes us again from the build directory
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE minivosc_trace
+#include <trace/define_trace.h>
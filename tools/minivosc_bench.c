@@ -0,0 +1,147 @@
+/*
+ *  Microbenchmark of the minivosc generator core, in userspace: bytes
+ *  per second the capture fill reaches, per format and channel count,
+ *  driven by a simulated timer that fires late by a random jitter
+ *  (and now and then by whole periods) - as the driver sees it.
+ *
+ *  make bench
+ *  tools/minivosc_bench [seconds per run] [max jitter in % of a period]
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include "minivosc_core.h"
+
+#define RATE		48000
+#define PERIOD_FRAMES	256
+#define PERIODS		4
+
+static double run_time = 0.2;	/* wall clock seconds per run */
+static unsigned int jitter = 20;	/* max timer lateness, % of a period */
+
+static const struct {
+	const char *name;
+	snd_pcm_format_t format;
+} formats[] = {
+	{ "U8", SNDRV_PCM_FORMAT_U8 },
+	{ "S16_LE", SNDRV_PCM_FORMAT_S16_LE },
+	{ "S24_LE", SNDRV_PCM_FORMAT_S24_LE },
+	{ "S32_LE", SNDRV_PCM_FORMAT_S32_LE },
+	{ "FLOAT_LE", SNDRV_PCM_FORMAT_FLOAT_LE },
+};
+
+static const unsigned int channel_counts[] = { 1, 2, 8, 32 };
+
+// the fill engines of the driver that are not architecture specific
+static const struct {
+	const char *name;
+	minivosc_gen_t gen;
+	bool image;
+	bool voices;	/* a frequency per channel */
+} engines[] = {
+	{ "memcpy", minivosc_gen, true, false },
+	{ "words", minivosc_gen_words, true, false },
+	{ "live", minivosc_gen, false, false },
+	{ "voices", minivosc_gen, false, true },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// simulated timer: each wakeup is due at the period end, but comes
+// late by up to jitter percent of a period; one in 64 is a whole
+// period or two late, which makes the engine catch up
+static u64 next_delta(struct minivosc_pos *pos, u64 period_ns)
+{
+	u64 delta = minivosc_pos_period_ns(pos);
+
+	delta += (u64)(rand() % 1001) * period_ns * jitter / 100000;
+	if (!(rand() & 63))
+		delta += (1 + rand() % 2) * period_ns;
+	return delta;
+}
+
+// bytes per second of one engine, format and channel count
+static double bench(unsigned int e, snd_pcm_format_t format,
+                    unsigned int channels)
+{
+	struct minivosc_signal sig = { .osc_wave = MINIVOSC_WAVE_SINE,
+	                               .osc_freq = 997, .osc_amp = 100 };
+	struct minivosc_pos pos = { 0 };
+	u64 period_ns = (u64)PERIOD_FRAMES * NSEC_PER_SEC / RATE;
+	unsigned int buffer_bytes, elapsed, off = 0, i;
+	double t0, t;
+	u64 bytes = 0;
+	char *buf;
+
+	minivosc_pos_setup(&pos, RATE, PERIOD_FRAMES, PERIOD_FRAMES * PERIODS);
+	if (engines[e].voices) {
+		sig.osc_voices = 1;
+		for (i = 0; i < channels; i++) {
+			sig.ch_freq[i] = 997 + 100 * i;
+			sig.ch_amp[i] = 100;
+		}
+	}
+	if (minivosc_signal_setup(&sig, format, channels, RATE,
+	                          PERIOD_FRAMES * PERIODS * 4 * channels,
+	                          engines[e].image))
+		return -1;
+	buffer_bytes = PERIOD_FRAMES * PERIODS * sig.frame_bytes;
+	buf = malloc(buffer_bytes);
+
+	srand(1);
+	t0 = now();
+	do {
+		for (i = 0; i < 256; i++) {
+			u64 count = minivosc_pos_advance(&pos,
+				next_delta(&pos, period_ns), &elapsed);
+
+			off = minivosc_signal_ring(&sig, buf, buffer_bytes, off,
+				count * sig.frame_bytes, engines[e].gen);
+			bytes += count * sig.frame_bytes;
+		}
+		t = now() - t0;
+	} while (t < run_time);
+
+	free(buf);
+	minivosc_signal_free(&sig);
+	return bytes / t;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int f, c, e;
+
+	if (argc > 1)
+		run_time = atof(argv[1]);
+	if (argc > 2)
+		jitter = atoi(argv[2]);
+
+	printf("%u Hz, %u frame periods, jitter up to %u%%; MB/s\n",
+	       RATE, PERIOD_FRAMES, jitter);
+	printf("%-9s %4s", "format", "ch");
+	for (e = 0; e < ARRAY_SIZE(engines); e++)
+		printf(" %9s", engines[e].name);
+	printf("\n");
+
+	for (f = 0; f < ARRAY_SIZE(formats); f++)
+		for (c = 0; c < ARRAY_SIZE(channel_counts); c++) {
+			printf("%-9s %4u", formats[f].name, channel_counts[c]);
+			for (e = 0; e < ARRAY_SIZE(engines); e++)
+				printf(" %9.1f", bench(e, formats[f].format,
+				       channel_counts[c]) / (1 << 20));
+			printf("\n");
+		}
+	return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ *  Feeds a minivosc capture subdevice from stdin, through the
+ *  injection ring of the card (see minivosc_inject.h): raw frames in
+ *  the format the capture runs with, e.g.
+ *
+ *  sox voice.wav -t raw -r 48000 -c 2 -e signed -b 16 - | \
+ *      tools/minivosc_inject /dev/snd/hwC1D0 0 silence &
+ *  arecord -D hw:1,0,0 -f S16_LE -r 48000 -c 2 out.wav
+ *
+ *  tools/minivosc_inject <hwdep device> [subdevice] [silence|repeat|osc]
+ *                        [frame bytes]
+ *
+ *  The input is not paced: the ring fills up, and then goes at the
+ *  speed of the capture. At the end of the input, it waits for the
+ *  ring to drain, and exits (detaching the ring).
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "minivosc_inject.h"
+
+#define RING_BYTES	(256 * 1024)
+
+static const char *policies[] = { "silence", "repeat", "osc" };
+
+static void nap(void)
+{
+	struct timespec ts = { 0, 2000000 };
+
+	nanosleep(&ts, NULL);
+}
+
+int main(int argc, char **argv)
+{
+	struct minivosc_inject_setup setup = { .bytes = RING_BYTES };
+	volatile struct minivosc_inject_ctl *ctl;
+	unsigned int frame_bytes = 4, n, space, off;
+	char *map, *data, *chunk;
+	__u32 head;
+	ssize_t got;
+	int fd;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <hwdep device> [subdevice] "
+		        "[silence|repeat|osc] [frame bytes]\n", argv[0]);
+		return 2;
+	}
+	if (argc > 2)
+		setup.subdevice = atoi(argv[2]);
+	if (argc > 3)
+		for (setup.underrun = 0; setup.underrun < 3; setup.underrun++)
+			if (!strcmp(argv[3], policies[setup.underrun]))
+				break;
+	if (argc > 4)
+		frame_bytes = atoi(argv[4]);
+	if (setup.underrun >= 3 || !frame_bytes) {
+		fprintf(stderr, "bad arguments\n");
+		return 2;
+	}
+
+	fd = open(argv[1], O_RDWR);
+	if (fd < 0 || ioctl(fd, MINIVOSC_IOCTL_INJECT_SETUP, &setup) < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	map = mmap(NULL, sysconf(_SC_PAGESIZE) + setup.bytes,
+	           PROT_READ | PROT_WRITE, MAP_SHARED, fd, setup.offset);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	ctl = (volatile struct minivosc_inject_ctl *)map;
+	data = map + ctl->data_offset;
+	chunk = malloc(setup.bytes);
+
+	// whole frames only: the rest waits for the next read
+	off = 0;
+	head = ctl->head;
+	while ((got = read(0, chunk + off, setup.bytes / 2 - off)) > 0) {
+		off += got;
+		n = off - off % frame_bytes;
+		while (n) {
+			space = ctl->size - (head - ctl->tail);
+			space -= space % frame_bytes;
+			if (space > n)
+				space = n;
+			if (!space) {
+				nap();
+				continue;
+			}
+			for (got = 0; got < space; got++)
+				data[(head + got) & (ctl->size - 1)] =
+					chunk[off - n + got];
+			__atomic_store_n(&ctl->head, head + space,
+			                 __ATOMIC_RELEASE);
+			head += space;
+			n -= space;
+		}
+		memmove(chunk, chunk + off - off % frame_bytes, off % frame_bytes);
+		off %= frame_bytes;
+	}
+
+	while (ctl->tail != head)
+		nap();
+	fprintf(stderr, "%u underruns\n", ctl->underruns);
+	return 0;
+}
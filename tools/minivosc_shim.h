@@ -0,0 +1,107 @@
+/*
+ *  Userspace stand-ins for the few kernel definitions minivosc_core.h
+ *  uses, so the generator core builds with the host compiler.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ */
+
+#ifndef MINIVOSC_SHIM_H
+#define MINIVOSC_SHIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef int64_t s64;
+
+#define S32_MAX	INT32_MAX
+#define S32_MIN	INT32_MIN
+#define NSEC_PER_SEC	1000000000L
+
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define __maybe_unused	__attribute__((unused))
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+#define min(a, b)	((a) < (b) ? (a) : (b))
+#define max(a, b)	((a) > (b) ? (a) : (b))
+#define min3(a, b, c)	min(min(a, b), c)
+#define min_t(type, a, b)	min((type)(a), (type)(b))
+#define clamp_t(type, v, lo, hi)	min_t(type, max((type)(v), (type)(lo)), (type)(hi))
+
+static inline u64 div_u64_rem(u64 dividend, u32 divisor, u32 *remainder)
+{
+	*remainder = dividend % divisor;
+	return dividend / divisor;
+}
+
+static inline u64 div_u64(u64 dividend, u32 divisor)
+{
+	return dividend / divisor;
+}
+
+static inline u64 div64_u64_rem(u64 dividend, u64 divisor, u64 *remainder)
+{
+	*remainder = dividend % divisor;
+	return dividend / divisor;
+}
+
+// as in the kernel: divides n in place, evaluates to the remainder
+#define do_div(n, base) ({			\
+	u32 __rem = (n) % (base);		\
+	(n) /= (base);				\
+	__rem;					\
+})
+
+static inline unsigned long gcd(unsigned long a, unsigned long b)
+{
+	while (b) {
+		unsigned long r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+static inline int fls(unsigned int x)
+{
+	return x ? 32 - __builtin_clz(x) : 0;
+}
+
+// the injection ring is shared with a producer thread
+#define ACCESS_ONCE(x)	(*(volatile __typeof__(x) *)&(x))
+#define smp_rmb()	__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_mb()	__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define vmalloc(size)	malloc(size)
+#define vfree(p)	free(p)
+
+#define get_unaligned(p) ({			\
+	__typeof__(*(p) + 0) __v;		\
+	memcpy(&__v, (p), sizeof(__v));		\
+	__v;					\
+})
+#define put_unaligned(v, p) do {		\
+	__typeof__(*(p)) __v = (v);		\
+	memcpy((p), &__v, sizeof(__v));		\
+} while (0)
+
+// the sound/asound.h values of the formats the generator stores
+typedef int snd_pcm_format_t;
+#define SNDRV_PCM_FORMAT_U8		1
+#define SNDRV_PCM_FORMAT_S16_LE		2
+#define SNDRV_PCM_FORMAT_S24_LE		6
+#define SNDRV_PCM_FORMAT_S32_LE		10
+#define SNDRV_PCM_FORMAT_FLOAT_LE	14
+
+#endif /* MINIVOSC_SHIM_H */
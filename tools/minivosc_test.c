@@ -0,0 +1,946 @@
+/*
+ *  Correctness checks of the minivosc generator core, in userspace:
+ *  buffer wrap-around, late (multi-period) timers, silence, and the
+ *  injection ring.
+ *
+ *  make check
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include "minivosc_core.h"
+
+static int failed;
+
+#define CHECK(cond, fmt, arg...) do {					\
+	if (!(cond)) {							\
+		printf("FAIL %s:%d: " fmt "\n", __func__, __LINE__, ## arg); \
+		failed++;						\
+	}								\
+} while (0)
+
+static const struct {
+	const char *name;
+	snd_pcm_format_t format;
+} formats[] = {
+	{ "U8", SNDRV_PCM_FORMAT_U8 },
+	{ "S16_LE", SNDRV_PCM_FORMAT_S16_LE },
+	{ "S24_LE", SNDRV_PCM_FORMAT_S24_LE },
+	{ "S32_LE", SNDRV_PCM_FORMAT_S32_LE },
+	{ "FLOAT_LE", SNDRV_PCM_FORMAT_FLOAT_LE },
+};
+
+static const unsigned int channel_counts[] = { 1, 2, 6 };
+
+static void signal_init(struct minivosc_signal *sig, unsigned int wave,
+                        unsigned int freq, unsigned int amp)
+{
+	memset(sig, 0, sizeof(*sig));
+	sig->osc_wave = wave;
+	sig->osc_freq = freq;
+	sig->osc_amp = amp;
+}
+
+// the same signal, once straight and once through a small ring buffer
+// in odd sized pieces, must give the same bytes
+static void test_wrap(snd_pcm_format_t format, unsigned int channels,
+                      unsigned int wave, bool image, minivosc_gen_t gen)
+{
+	struct minivosc_signal ref, sig;
+	unsigned int buffer_frames = 1001, total_frames = 20000;
+	unsigned int fb, buffer_bytes, off = 0, done = 0, step = 0, i;
+	char *linear, *ring;
+
+	signal_init(&ref, wave, 440, 80);
+	signal_init(&sig, wave, 440, 80);
+	CHECK(!minivosc_signal_setup(&ref, format, channels, 44100, 0, false),
+	      "setup");
+	fb = ref.frame_bytes;
+	buffer_bytes = buffer_frames * fb;
+	CHECK(!minivosc_signal_setup(&sig, format, channels, 44100,
+	                             buffer_bytes, image), "setup");
+	CHECK(!image || sig.wvf_cache, "no image");
+
+	linear = malloc(total_frames * fb);
+	ring = malloc(buffer_bytes);
+	minivosc_gen(&ref, linear, total_frames * fb);
+
+	while (done < total_frames) {
+		unsigned int frames = min(total_frames - done, 1 + (step++ * 37) % 700);
+
+		off = minivosc_signal_ring(&sig, ring, buffer_bytes, off,
+		                           frames * fb, gen);
+		done += frames;
+		// the ring now ends with the last bytes of the signal
+		for (i = 0; i < min(done, buffer_frames) * fb; i++) {
+			unsigned int r = (off + buffer_bytes - 1 - i) % buffer_bytes;
+			if (ring[r] != linear[done * fb - 1 - i])
+				break;
+		}
+		if (i < min(done, buffer_frames) * fb) {
+			CHECK(0, "format %d channels %u wave %u image %d: "
+			      "differs at frame %u", format, channels, wave,
+			      image, done - 1 - i / fb);
+			break;
+		}
+	}
+	CHECK(off == (total_frames % buffer_frames) * fb, "ring offset %u", off);
+
+	free(ring);
+	free(linear);
+	minivosc_signal_free(&ref);
+	minivosc_signal_free(&sig);
+}
+
+// more than a buffer at once (a late timer): only the last buffer is
+// written, and it holds what a timely fill would have left there
+static void test_late_fill(unsigned int wave, bool image)
+{
+	struct minivosc_signal ref, sig;
+	unsigned int buffer_frames = 480, late_frames = 3 * 480 + 77;
+	unsigned int fb, buffer_bytes, off;
+	char *linear, *ring;
+
+	signal_init(&ref, wave, 1000, 100);
+	signal_init(&sig, wave, 1000, 100);
+	minivosc_signal_setup(&ref, SNDRV_PCM_FORMAT_S16_LE, 2, 48000, 0, false);
+	fb = ref.frame_bytes;
+	buffer_bytes = buffer_frames * fb;
+	minivosc_signal_setup(&sig, SNDRV_PCM_FORMAT_S16_LE, 2, 48000,
+	                      buffer_bytes, image);
+
+	linear = malloc((late_frames + 1) * fb);
+	ring = calloc(1, buffer_bytes);
+	minivosc_gen(&ref, linear, (late_frames + 1) * fb);
+
+	off = minivosc_signal_ring(&sig, ring, buffer_bytes, 0,
+	                           late_frames * fb, minivosc_gen);
+	CHECK(off == (late_frames % buffer_frames) * fb, "offset %u", off);
+	CHECK(!memcmp(ring + off, linear + (late_frames - buffer_frames) * fb,
+	              buffer_bytes - off) &&
+	      !memcmp(ring, linear + (late_frames - off / fb) * fb, off),
+	      "wave %u image %d: late fill content", wave, image);
+	// ... and the signal goes on from where it should
+	minivosc_signal_ring(&sig, ring, buffer_bytes, off, fb, minivosc_gen);
+	CHECK(!memcmp(ring + off, linear + late_frames * fb, fb),
+	      "wave %u image %d: signal continues wrong", wave, image);
+
+	free(ring);
+	free(linear);
+	minivosc_signal_free(&ref);
+	minivosc_signal_free(&sig);
+}
+
+// lazy mmap capture, as the driver does it: generates up to frame target
+// (see minivosc_lazy_fill)
+static void lazy_gen(struct minivosc_signal *sig, char *ring,
+                     unsigned long buffer, unsigned long boundary,
+                     unsigned long *done, unsigned long target)
+{
+	unsigned int fb = sig->frame_bytes;
+	unsigned long frames;
+
+	frames = minivosc_lazy_window(*done, target, buffer, boundary);
+	if (!frames)
+		return;
+	*done = target;
+	minivosc_signal_ring(sig, ring, buffer * fb,
+	                     (target + boundary - frames) % buffer * fb,
+	                     frames * fb, minivosc_gen);
+}
+
+// an mmap reader of lazy capture, through many buffers and wraps of the
+// boundary, reading all there is now and then: with ack (as after a
+// forward) or without (the timer alone keeps ahead), every frame read
+// must be the next one of the signal
+static void test_lazy_mmap(bool ack)
+{
+	struct minivosc_signal ref, sig;
+	struct minivosc_pos pos = { 0 };
+	unsigned long period = 240, buffer = 4 * 240, boundary = 4 * buffer;
+	unsigned long done = 0, appl = 0, hw, n, k, size;
+	unsigned int rate = 48000, fb, elapsed, step, bad = 0;
+	u64 frames = 0;
+	char *ring, *want;
+
+	signal_init(&ref, MINIVOSC_WAVE_SINE, 1000, 100);
+	signal_init(&sig, MINIVOSC_WAVE_SINE, 1000, 100);
+	minivosc_signal_setup(&ref, SNDRV_PCM_FORMAT_S16_LE, 2, rate, 0, false);
+	minivosc_signal_setup(&sig, SNDRV_PCM_FORMAT_S16_LE, 2, rate, 0, false);
+	fb = sig.frame_bytes;
+	ring = calloc(buffer, fb);
+	want = malloc(buffer * fb);
+	minivosc_pos_setup(&pos, rate, period, buffer);
+
+	// prepare: the first buffer
+	lazy_gen(&sig, ring, buffer, boundary, &done, buffer);
+	srand(ack);
+	for (step = 0; step < 2000; step++) {
+		// the timer, a bit late
+		minivosc_pos_advance(&pos, minivosc_pos_period_ns(&pos) +
+		                     rand() % 100000, &elapsed);
+		hw = pos.frames % boundary;
+		lazy_gen(&sig, ring, buffer, boundary, &done,
+		         minivosc_lazy_target(hw, appl, period, buffer,
+		                              boundary));
+
+		n = (hw + boundary - appl) % boundary;
+		if (n < 2 * period && rand() % 2)
+			continue;
+		minivosc_gen(&ref, want, n * fb);
+		for (k = 0; k < n; k += size) {
+			size = min(n - k, buffer - (appl + k) % buffer);
+			if (memcmp(ring + (appl + k) % buffer * fb,
+			           want + k * fb, size * fb))
+				bad++;
+		}
+		appl = (appl + n) % boundary;
+		frames += n;
+		if (ack)
+			lazy_gen(&sig, ring, buffer, boundary, &done,
+			         (appl + buffer) % boundary);
+	}
+	CHECK(!bad, "ack %d: %u reads with stale data", ack, bad);
+	CHECK(frames > 10 * boundary, "ack %d: only %llu frames read", ack,
+	      (unsigned long long)frames);
+
+	free(want);
+	free(ring);
+	minivosc_signal_free(&ref);
+	minivosc_signal_free(&sig);
+}
+
+// amplitude 0: silence in every format - 0x80 for U8, else all zero
+static void test_silence(snd_pcm_format_t format, unsigned int channels)
+{
+	struct minivosc_signal sig;
+	unsigned int bytes, i;
+	unsigned char *buf;
+	unsigned char zero = format == SNDRV_PCM_FORMAT_U8 ? 0x80 : 0;
+	unsigned int wave;
+
+	for (wave = MINIVOSC_WAVE_TABLE; wave <= MINIVOSC_WAVE_TRIANGLE; wave++) {
+		signal_init(&sig, wave, 997, 0);
+		CHECK(!minivosc_signal_setup(&sig, format, channels, 48000,
+		                             4800 * 8, true), "setup");
+		bytes = 1234 * sig.frame_bytes;
+		buf = malloc(bytes);
+		minivosc_gen(&sig, (char *)buf, bytes);
+		for (i = 0; i < bytes; i++)
+			if (buf[i] != zero)
+				break;
+		CHECK(i == bytes, "format %d wave %u: byte %u is %#x", format,
+		      wave, i, buf[i]);
+		free(buf);
+		minivosc_signal_free(&sig);
+	}
+}
+
+// the image is one exact cycle: sine at 1 kHz/48 kHz repeats after 48
+// frames, and its first frame is a zero crossing
+static void test_image_cycle(void)
+{
+	struct minivosc_signal sig;
+
+	signal_init(&sig, MINIVOSC_WAVE_SINE, 1000, 100);
+	minivosc_signal_setup(&sig, SNDRV_PCM_FORMAT_S32_LE, 1, 48000, 4096, true);
+	CHECK(sig.wvf_cycle_bytes == 48 * 4, "cycle %u", sig.wvf_cycle_bytes);
+	CHECK(!memcmp(sig.wvf_cache, sig.wvf_cache + sig.wvf_cycle_bytes,
+	              sig.wvf_span_bytes), "image does not repeat");
+	CHECK(*(const s32 *)sig.wvf_cache == 0, "starts at %d",
+	      *(const s32 *)sig.wvf_cache);
+	minivosc_signal_free(&sig);
+
+	// too long a cycle: no image, generated live
+	signal_init(&sig, MINIVOSC_WAVE_SINE, 1, 100);
+	minivosc_signal_setup(&sig, SNDRV_PCM_FORMAT_FLOAT_LE, 32, 384000,
+	                      4096, true);
+	CHECK(!sig.wvf_cache, "image of %u bytes", sig.wvf_cycle_bytes);
+}
+
+// an image rendered for one signal serves another of the same key
+// (as the driver shares them between streams) - byte for byte, also
+// where the borrowed image is larger; other parameters, other keys
+static void test_image_share(snd_pcm_format_t format, unsigned int channels,
+                             unsigned int wave, bool voiced)
+{
+	struct minivosc_signal own, sig;
+	struct minivosc_image_key k1, k2;
+	unsigned int bytes, fb, c;
+	char *image, *a, *b;
+
+	signal_init(&own, wave, 1000, 70);
+	signal_init(&sig, wave, 1000, 70);
+	own.osc_voices = sig.osc_voices = voiced;
+	for (c = 0; c < channels; c++) {
+		own.ch_freq[c] = sig.ch_freq[c] = 500 * (c % 3);
+		own.ch_amp[c] = sig.ch_amp[c] = 100 - c;
+		own.ch_phase[c] = sig.ch_phase[c] = 45 * c;
+	}
+	CHECK(!minivosc_signal_setup(&own, format, channels, 48000, 4096, true),
+	      "setup");
+	CHECK(!minivosc_signal_setup(&sig, format, channels, 48000, 2048, false),
+	      "setup");
+	fb = sig.frame_bytes;
+	CHECK(own.wvf_cache && !sig.wvf_cache, "images %d %d",
+	      !!own.wvf_cache, !!sig.wvf_cache);
+	minivosc_signal_key(&own, &k1);
+	minivosc_signal_key(&sig, &k2);
+	CHECK(!memcmp(&k1, &k2, sizeof(k1)), "keys differ");
+
+	bytes = minivosc_signal_image_bytes(&own);
+	CHECK(bytes > minivosc_signal_image_bytes(&sig), "image bytes %u", bytes);
+	image = malloc(bytes);
+	minivosc_signal_render(&sig, image, bytes);
+	CHECK(!memcmp(image, own.wvf_cache, bytes), "renders differ");
+	minivosc_signal_use(&sig, image);
+
+	a = malloc(20000 * fb);
+	b = malloc(20000 * fb);
+	minivosc_gen(&own, a, 7 * fb);
+	minivosc_gen(&sig, b, 7 * fb);
+	minivosc_gen(&own, a + 7 * fb, 19993 * fb);
+	minivosc_gen(&sig, b + 7 * fb, 19993 * fb);
+	CHECK(!memcmp(a, b, 20000 * fb), "signals differ");
+
+	sig.osc_amp = 69;
+	minivosc_signal_setup(&sig, format, channels, 48000, 2048, false);
+	minivosc_signal_key(&sig, &k2);
+	CHECK(memcmp(&k1, &k2, sizeof(k1)), "amplitude not in the key");
+	if (voiced) {
+		sig.osc_amp = 70;
+		sig.ch_phase[channels - 1]++;
+		minivosc_signal_setup(&sig, format, channels, 48000, 2048, false);
+		minivosc_signal_key(&sig, &k2);
+		CHECK(memcmp(&k1, &k2, sizeof(k1)), "phase not in the key");
+	}
+
+	free(a);
+	free(b);
+	free(image);
+	minivosc_signal_free(&own);
+}
+
+// retuning while running: the image is dropped, and the oscillator
+// goes on exactly where the image was (the table wave is integral, so
+// there it is the very same signal)
+static void test_retune(void)
+{
+	struct minivosc_signal ref, sig;
+	unsigned int fb, i, n = 1000;
+	s32 *a, *b;
+
+	signal_init(&ref, MINIVOSC_WAVE_TABLE, 440, 80);
+	signal_init(&sig, MINIVOSC_WAVE_TABLE, 440, 80);
+	minivosc_signal_setup(&ref, SNDRV_PCM_FORMAT_S32_LE, 2, 48000, 0, false);
+	minivosc_signal_setup(&sig, SNDRV_PCM_FORMAT_S32_LE, 2, 48000, 4800, true);
+	fb = sig.frame_bytes;
+	a = malloc(2 * n * fb);
+	b = malloc(2 * n * fb);
+	minivosc_gen(&ref, (char *)a, 2 * n * fb);
+	minivosc_gen(&sig, (char *)b, 333 * fb);
+	minivosc_signal_live(&sig);
+	minivosc_signal_tune(&sig);
+	CHECK(!sig.wvf_cache, "still using the image");
+	minivosc_gen(&sig, (char *)b + 333 * fb, (2 * n - 333) * fb);
+	CHECK(!memcmp(a, b, 2 * n * fb), "table wave: not continuous");
+	minivosc_signal_free(&ref);
+	minivosc_signal_free(&sig);
+
+	// sine: within the rounding of the phase increment
+	signal_init(&ref, MINIVOSC_WAVE_SINE, 1000, 100);
+	signal_init(&sig, MINIVOSC_WAVE_SINE, 1000, 100);
+	minivosc_signal_setup(&ref, SNDRV_PCM_FORMAT_S32_LE, 1, 44100, 0, false);
+	minivosc_signal_setup(&sig, SNDRV_PCM_FORMAT_S32_LE, 1, 44100, 8192, true);
+	minivosc_gen(&ref, (char *)a, n * 4);
+	minivosc_gen(&sig, (char *)b, 500 * 4);
+	minivosc_signal_live(&sig);
+	minivosc_gen(&sig, (char *)b + 500 * 4, (n - 500) * 4);
+	for (i = 0; i < n; i++)
+		if (llabs((s64)a[i] - b[i]) > 1 << 12)
+			break;
+	CHECK(i == n, "sine: frame %u is %d, not %d", i, b[i], a[i]);
+
+	// DC offset, saturating; mute silences it too
+	sig.osc_wave = MINIVOSC_WAVE_SQUARE;
+	sig.osc_lift = 50;
+	minivosc_signal_tune(&sig);
+	minivosc_gen(&sig, (char *)b, n * 4);
+	for (i = 0; i < n; i++)
+		if (b[i] != S32_MAX && b[i] != S32_MIN + 1 + 50 * (S32_MAX / 100))
+			break;
+	CHECK(i == n, "square + 50%%: frame %u is %d", i, b[i]);
+	sig.osc_mute = 1;
+	minivosc_signal_tune(&sig);
+	minivosc_gen(&sig, (char *)b, n * 4);
+	for (i = 0; i < n; i++)
+		if (b[i])
+			break;
+	CHECK(i == n, "muted: frame %u is %d", i, b[i]);
+
+	free(a);
+	free(b);
+	minivosc_signal_free(&ref);
+	minivosc_signal_free(&sig);
+}
+
+// per channel oscillators: each channel of the interleaved frames must
+// be the mono signal of its own frequency, amplitude and phase - from
+// the image, live, after leaving the image and across a skip. At a
+// rate of 2^15 Hz the phase increments are exact, so all of them are
+// bit for bit the same.
+static void test_voices(snd_pcm_format_t format, unsigned int channels,
+                        bool image)
+{
+	static const unsigned int hz[] = { 0, 1500, 64, 4096, 1000, 8000 };
+	static const unsigned int amp[] = { 100, 50, 25, 0, 100, 75 };
+	static const unsigned int deg[] = { 0, 90, 180, 45, 359, 720 };
+	struct minivosc_signal sig, ref;
+	unsigned int rate = 32768, frames = 20000, skip = 777;
+	unsigned int fb, sb, c, f, a = 6000;
+	char *out, *one;
+
+	signal_init(&sig, MINIVOSC_WAVE_SINE, 1000, 100);
+	sig.osc_voices = 1;
+	for (c = 0; c < channels; c++) {
+		sig.ch_freq[c] = hz[c % 6];
+		sig.ch_amp[c] = amp[c % 6];
+		sig.ch_phase[c] = deg[c % 6];
+	}
+	CHECK(!minivosc_signal_setup(&sig, format, channels, rate,
+	                             4096 * 4 * channels, image), "setup");
+	CHECK(!image || sig.wvf_cache, "channels %u: no image", channels);
+	fb = sig.frame_bytes;
+	sb = fb / channels;
+	out = malloc(frames * fb);
+	one = malloc(frames * sb);
+
+	minivosc_gen(&sig, out, 1111 * fb);
+	minivosc_gen(&sig, out + 1111 * fb, (a - 1111) * fb);
+	minivosc_signal_live(&sig);
+	CHECK(!sig.wvf_cache, "still using the image");
+	minivosc_signal_skip(&sig, skip * fb);
+	minivosc_gen(&sig, out + (a + skip) * fb, (frames - a - skip) * fb);
+
+	for (c = 0; c < channels; c++) {
+		signal_init(&ref, MINIVOSC_WAVE_SINE, hz[c % 6] ? hz[c % 6] : 1000,
+		            amp[c % 6]);
+		minivosc_signal_setup(&ref, format, 1, rate, 0, false);
+		ref.osc_phase = (u64)(deg[c % 6] % 360) * (1ULL << 32) / 360;
+		minivosc_gen(&ref, one, frames * sb);
+		for (f = 0; f < frames; f++) {
+			if (f >= a && f < a + skip)
+				continue;
+			if (memcmp(out + f * fb + c * sb, one + f * sb, sb))
+				break;
+		}
+		CHECK(f == frames, "format %d channels %u image %d: channel %u "
+		      "differs at frame %u", format, channels, image, c, f);
+		minivosc_signal_free(&ref);
+	}
+
+	// retuning keeps the phases, but for a changed phase offset;
+	// back to one oscillator, it goes on from channel 0
+	f = sig.voice[0].phase;
+	sig.ch_phase[0] += 90;
+	minivosc_signal_tune(&sig);
+	CHECK(sig.voice[0].phase - f == 0x40000000, "phase moved by %#x",
+	      sig.voice[0].phase - f);
+	sig.osc_voices = 0;
+	minivosc_signal_tune(&sig);
+	CHECK(sig.osc_phase == f, "phase %#x, not %#x", sig.osc_phase, f);
+	sig.osc_voices = 1;
+
+	// 997 Hz at 192 kHz repeats after a second: an image only if
+	// that is at most MAX_CYCLE_BYTES
+	sig.ch_freq[0] = 997;
+	minivosc_signal_setup(&sig, format, channels, 192000, 4096, true);
+	CHECK(!sig.wvf_cache == (192000 * fb > MAX_CYCLE_BYTES),
+	      "channels %u: image %d", channels, !!sig.wvf_cache);
+
+	free(one);
+	free(out);
+	minivosc_signal_free(&sig);
+}
+
+static void test_float(void)
+{
+	static const s32 v[] = { 0, 1, -1, 12345, -98765, 1 << 30,
+		S32_MAX, S32_MIN + 1, S32_MIN, 0x12345678 };
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(v); i++) {
+		u32 bits = minivosc_q31_to_float(v[i]);
+		float f, want = ldexp(v[i], -31);
+
+		memcpy(&f, &bits, sizeof(f));
+		// the mantissa is truncated, not rounded
+		CHECK(fabs(f - want) <= ldexp(fabs(want), -23),
+		      "%d: %g, not %g", v[i], f, want);
+	}
+}
+
+// frames the position engine should have counted after ns
+static u64 exact_frames(u64 ns, unsigned int rate)
+{
+	return (u64)((unsigned __int128)ns * rate / NSEC_PER_SEC);
+}
+
+// a single late update must end up where many small ones do
+static void test_catchup(unsigned int rate, unsigned int period,
+                         unsigned int buffer, u64 late_ns)
+{
+	struct minivosc_pos a = { 0 }, b = { 0 };
+	unsigned int elapsed, periods = 0, step = 1000000;
+	u64 t, frames = 0, count;
+
+	minivosc_pos_setup(&a, rate, period, buffer);
+	minivosc_pos_setup(&b, rate, period, buffer);
+
+	for (t = 0; t < late_ns; t += step) {
+		frames += minivosc_pos_advance(&a, min_t(u64, step, late_ns - t),
+		                               &elapsed);
+		periods += !!elapsed;
+	}
+	CHECK(frames == exact_frames(late_ns, rate),
+	      "small steps: %llu frames, not %llu", (unsigned long long)frames,
+	      (unsigned long long)exact_frames(late_ns, rate));
+
+	count = minivosc_pos_advance(&b, late_ns, &elapsed);
+	CHECK(a.irq_pos == b.irq_pos, "rate %u late %llu: irq_pos %llu vs %llu",
+	      rate, (unsigned long long)late_ns,
+	      (unsigned long long)a.irq_pos, (unsigned long long)b.irq_pos);
+	if (frames > buffer)
+		CHECK(count == buffer + frames % buffer, "count %llu",
+		      (unsigned long long)count);
+	else
+		CHECK(count == frames, "count %llu", (unsigned long long)count);
+	if (frames >= 2 * (u64)period)
+		CHECK(elapsed == (MINIVOSC_POS_PERIOD | MINIVOSC_POS_CATCHUP),
+		      "elapsed %#x", elapsed);
+	else if (periods)
+		CHECK(elapsed & MINIVOSC_POS_PERIOD, "no period end");
+	CHECK(b.irq_pos < b.period_size_frac, "irq_pos past the period");
+}
+
+// an hour of jittery timer steps: no frame lost, no drift, the link
+// time always that of the whole frames counted, and the clock alone
+// telling the same (as _pointer has it)
+static void test_drift(unsigned int rate, unsigned int period)
+{
+	struct minivosc_pos pos = { 0 };
+	unsigned int elapsed, periods = 0, bad_link = 0, bad_clock = 0;
+	u64 t = 0, frames = 0, end = 3600ULL * NSEC_PER_SEC;
+	u64 period_ns = (u64)period * NSEC_PER_SEC / rate;
+
+	srand(rate);
+	minivosc_pos_setup(&pos, rate, period, period * 4);
+	while (t < end) {
+		u64 delta = min_t(u64, minivosc_pos_period_ns(&pos) +
+		                  rand() % (period_ns / 4 + 1), end - t);
+
+		frames += minivosc_pos_advance(&pos, delta, &elapsed);
+		periods += !!elapsed;
+		t += delta;
+		// the (position, time) pair of the audio timestamps
+		if (t - minivosc_pos_frame_age_ns(&pos) != minivosc_pos_link_ns(&pos))
+			bad_link++;
+		if (minivosc_link_frames(t, rate) != pos.frames ||
+		    minivosc_link_frames(minivosc_pos_link_ns(&pos) - 1, rate) !=
+		    pos.frames - 1 ||
+		    (pos.frames + minivosc_pos_period_left(&pos)) % period)
+			bad_clock++;
+	}
+	CHECK(!bad_link, "rate %u: %u link times off", rate, bad_link);
+	CHECK(!bad_clock, "rate %u: %u clock positions off", rate, bad_clock);
+	CHECK(frames == exact_frames(end, rate), "rate %u: %llu frames, not %llu",
+	      rate, (unsigned long long)frames,
+	      (unsigned long long)exact_frames(end, rate));
+	CHECK(periods <= frames / period && periods + 1 >= frames * 4 / 5 / period,
+	      "rate %u: %u period ends for %llu frames", rate, periods,
+	      (unsigned long long)frames);
+}
+
+static u64 get_le(const u8 *p, unsigned int bytes)
+{
+	u64 v = 0;
+
+	while (bytes--)
+		v = (v << 8) | p[bytes];
+	return v;
+}
+
+// checks the records in the last valid frames of the ring, which end
+// at frame end, whose next frame (at off) is the oldest one; returns
+// how many there are
+static unsigned int probe_check(const struct minivosc_probe *pr, u64 end,
+                        unsigned int valid, const char *ring,
+                        unsigned int buffer_frames, unsigned int off)
+{
+	unsigned int k, r, n, seen = 0;
+	u8 rec[MINIVOSC_PROBE_BYTES];
+	u64 first, frame, ns, want;
+
+	if (end < buffer_frames)
+		return 0;
+	first = end - buffer_frames;
+	for (k = buffer_frames - valid; k < buffer_frames; k++) {
+		frame = first + k;
+		if (frame % pr->interval ||
+		    frame + pr->record_frames > end)
+			continue;
+		for (r = 0; r < pr->record_frames; r++) {
+			const char *slot = ring + (off + (k + r) * pr->frame_bytes) %
+				(buffer_frames * pr->frame_bytes) + pr->slot_offset;
+
+			n = min(pr->slot_bytes, MINIVOSC_PROBE_BYTES - r * pr->slot_bytes);
+			memcpy(rec + r * pr->slot_bytes, slot, n);
+		}
+		ns = get_le(rec + 12, 8);
+		want = ((frame + 1) * NSEC_PER_SEC + pr->rate - 1) / pr->rate;
+		CHECK(get_le(rec, 4) == MINIVOSC_PROBE_MAGIC &&
+		      get_le(rec + 4, 8) == frame && ns == want,
+		      "frame %llu: record %#llx %llu %llu, not %llu",
+		      (unsigned long long)frame,
+		      (unsigned long long)get_le(rec, 4),
+		      (unsigned long long)get_le(rec + 4, 8),
+		      (unsigned long long)ns, (unsigned long long)want);
+		seen++;
+	}
+	return seen;
+}
+
+// jittered fills with probe records, as the driver does them: up to
+// the end of the period, ahead of the position, or (capped) behind it.
+// Every record in the buffer must name its own frame, and the exact
+// time that frame was complete - also when its slots were written by
+// different fills
+static void test_probe(snd_pcm_format_t format, unsigned int channels,
+                       int channel, unsigned int interval)
+{
+	struct minivosc_signal sig;
+	struct minivosc_pos pos = { 0 };
+	struct minivosc_probe pr;
+	unsigned int rate = 44100, buffer_frames = 1024, buffer_bytes;
+	unsigned int elapsed, fb, off = 0, start, step, seen = 0, valid = 0;
+	u64 now = 0, delta, head = 0;
+	s64 ahead, n;
+	char *ring;
+
+	signal_init(&sig, MINIVOSC_WAVE_SINE, 440, 100);
+	minivosc_signal_setup(&sig, format, channels, rate, 0, false);
+	fb = sig.frame_bytes;
+	buffer_bytes = buffer_frames * fb;
+	ring = malloc(buffer_bytes);
+	minivosc_pos_setup(&pos, rate, 256, buffer_frames);
+	minivosc_probe_setup(&pr, interval, channel, channels, fb, rate);
+	CHECK(pr.interval >= pr.record_frames, "interval %u", pr.interval);
+
+	srand(interval);
+	for (step = 0; step < 500; step++) {
+		// now and then a timer late by more than a buffer
+		delta = 1000 + rand() % (step % 50 ? 3000000 : 50000000);
+		now += delta;
+		minivosc_pos_advance(&pos, delta, &elapsed);
+		ahead = head - pos.frames;
+		if (ahead < -(s64)buffer_frames) {
+			n = -ahead - buffer_frames;
+			off = (off + n % buffer_frames * fb) % buffer_bytes;
+			head += n;
+			ahead = -(s64)buffer_frames;
+			valid = 0;
+		}
+		n = min_t(s64, minivosc_pos_period_left(&pos) - ahead, 512);
+		if (n <= 0)
+			continue;
+		start = off;
+		off = minivosc_signal_ring(&sig, ring, buffer_bytes, off,
+		                           n * fb, minivosc_gen);
+		head += n;
+		valid = min_t(u64, valid + n, buffer_frames);
+		minivosc_probe_mark(&pr, &pos, head, now, ring, buffer_bytes,
+		                    start, n * fb);
+		seen += probe_check(&pr, head, valid, ring, buffer_frames, off);
+	}
+	CHECK(seen, "format %d channels %u channel %d: no records", format,
+	      channels, channel);
+	free(ring);
+	minivosc_signal_free(&sig);
+}
+
+/*
+ * injection ring
+ */
+struct inject_ring {
+	struct minivosc_inject_ctl ctl;
+	struct minivosc_inject inj;
+	char *data;
+};
+
+static inline u8 inject_byte(u32 pos)
+{
+	return pos * 131 + (pos >> 11);
+}
+
+static void inject_ring_init(struct inject_ring *r, u32 size,
+                             unsigned int underrun)
+{
+	memset(&r->ctl, 0, sizeof(r->ctl));
+	r->data = malloc(size);
+	minivosc_inject_init(&r->inj, &r->ctl, r->data, size, underrun);
+}
+
+// the producer side: bytes more of the byte stream
+static void inject_produce(struct inject_ring *r, u32 bytes)
+{
+	u32 head = ACCESS_ONCE(r->ctl.head);
+
+	for (; bytes; bytes--, head++)
+		r->data[head & r->inj.mask] = inject_byte(head);
+	__atomic_store_n(&r->ctl.head, head, __ATOMIC_RELEASE);
+}
+
+// drains of odd sizes, with the producer now ahead, now behind, now
+// far behind, once overrunning the ring, and late timers: the data
+// must come through exactly once and in order, what is missing as
+// the policy says, and the ring indices must stay consistent
+static void test_inject(snd_pcm_format_t format, unsigned int channels,
+                        unsigned int underrun)
+{
+	struct minivosc_signal sig, ref;
+	struct inject_ring r;
+	unsigned int buffer_frames = 500, fb, buffer_bytes, off = 0, start;
+	unsigned int step, total, count, n, i, underruns = 0;
+	u32 rd = 0, history = 0, loop = 0, head, avail, size = 4096;
+	char *ring, *want;
+	u8 silence = format == SNDRV_PCM_FORMAT_U8 ? 0x80 : 0;
+
+	signal_init(&sig, MINIVOSC_WAVE_SINE, 997, 50);
+	signal_init(&ref, MINIVOSC_WAVE_SINE, 997, 50);
+	minivosc_signal_setup(&sig, format, channels, 48000, 0, false);
+	minivosc_signal_setup(&ref, format, channels, 48000, 0, false);
+	fb = sig.frame_bytes;
+	buffer_bytes = buffer_frames * fb;
+	ring = malloc(buffer_bytes);
+	want = malloc(buffer_bytes);
+	inject_ring_init(&r, size, underrun);
+
+	srand(underrun * 100 + channels);
+	for (step = 0; step < 2000; step++) {
+		// the producer: whole frames, mostly within the free space
+		head = r.ctl.head;
+		n = rand() % (step % 10 ? 700 : 1) * fb;
+		if (step == 1000)
+			n = size * 3; // overrun
+		else if (n > size - (head - r.ctl.tail))
+			n = (size - (head - r.ctl.tail)) / fb * fb;
+		inject_produce(&r, n);
+
+		// the model of the consumer
+		total = count = (1 + rand() % (step % 97 ? 300 : 1500)) * fb;
+		avail = r.ctl.head - rd;
+		if (avail > size) {
+			n = (avail - size + fb - 1) / fb * fb;
+			rd += n;
+			avail -= n;
+		}
+		avail -= avail % fb;
+		start = off;
+		if (count > buffer_bytes) { // late: the oldest is dropped
+			n = min(count - buffer_bytes, avail);
+			rd += n;
+			avail -= n;
+			if (n) {
+				history = min(history + n, size / fb * fb);
+				loop = 0;
+			}
+			start = (start + count - buffer_bytes) % buffer_bytes;
+			count = buffer_bytes;
+		}
+		n = min(avail, count);
+		for (i = 0; i < n; i++)
+			want[i] = inject_byte(rd + i);
+		rd += n;
+		if (n) {
+			history = min(history + n, size / fb * fb);
+			loop = 0;
+		}
+		if (n < count) {
+			underruns++;
+			if (underrun == MINIVOSC_INJECT_UNDERRUN_OSC) {
+				minivosc_gen(&ref, want + n, count - n);
+			} else if (underrun == MINIVOSC_INJECT_UNDERRUN_REPEAT &&
+			           history) {
+				for (i = n; i < count; i++) {
+					want[i] = inject_byte(rd - history + loop);
+					loop = (loop + 1) % history;
+				}
+			} else {
+				memset(want + n, silence, count - n);
+			}
+		}
+
+		i = minivosc_inject_drain(&r.inj, &sig, silence, ring,
+		                          buffer_bytes, off, total);
+		CHECK(i == n, "step %u: took %u, not %u", step, i, n);
+		off = (off + total) % buffer_bytes;
+		for (i = 0; i < count; i++)
+			if (ring[(start + i) % buffer_bytes] != want[i])
+				break;
+		if (i < count) {
+			CHECK(0, "format %d channels %u underrun %u step %u: "
+			      "differs at byte %u of %u (%u from the ring)",
+			      format, channels, underrun, step, i, count, n);
+			break;
+		}
+		CHECK(r.ctl.tail == rd, "tail %u, not %u", r.ctl.tail, rd);
+	}
+	CHECK(r.ctl.underruns == underruns, "underruns %u, not %u",
+	      r.ctl.underruns, underruns);
+
+	free(r.data);
+	free(want);
+	free(ring);
+	minivosc_signal_free(&sig);
+	minivosc_signal_free(&ref);
+}
+
+#define INJECT_THREAD_BYTES	(4 * 1024 * 1024)
+
+static void *inject_producer(void *arg)
+{
+	struct inject_ring *r = arg;
+	u32 head = 0, space, n;
+	unsigned int seed = 1;
+
+	while (head < INJECT_THREAD_BYTES) {
+		space = r->inj.mask + 1 -
+			(head - __atomic_load_n(&r->ctl.tail, __ATOMIC_ACQUIRE));
+		n = (1 + rand_r(&seed) % 3000) * 4;
+		n = min3(space, n, INJECT_THREAD_BYTES - head);
+		n -= n % 4;
+		if (n)
+			inject_produce(r, n);
+		else
+			sched_yield(); // full: let the consumer run
+		head += n;
+	}
+	return NULL;
+}
+
+// the ring shared for real, producer and driver racing: the data has
+// to arrive whole, in order, and never overwritten before it is read
+static void test_inject_thread(void)
+{
+	struct minivosc_signal sig;
+	struct inject_ring r;
+	unsigned int buffer_bytes = 4096 * 4, off = 0, count, n, i;
+	unsigned int seed = 2;
+	u32 rd = 0;
+	pthread_t producer;
+	char *ring;
+
+	signal_init(&sig, MINIVOSC_WAVE_SINE, 997, 50);
+	minivosc_signal_setup(&sig, SNDRV_PCM_FORMAT_S16_LE, 2, 48000, 0, false);
+	ring = malloc(buffer_bytes);
+	inject_ring_init(&r, 8192, MINIVOSC_INJECT_UNDERRUN_SILENCE);
+	pthread_create(&producer, NULL, inject_producer, &r);
+
+	while (rd < INJECT_THREAD_BYTES) {
+		count = (1 + rand_r(&seed) % 1024) * 4;
+		n = minivosc_inject_drain(&r.inj, &sig, 0, ring, buffer_bytes,
+		                          off, count);
+		for (i = 0; i < n; i++)
+			if ((u8)ring[(off + i) % buffer_bytes] != inject_byte(rd + i))
+				break;
+		if (i < n) {
+			CHECK(0, "byte %u of the stream differs", rd + i);
+			break;
+		}
+		rd += n;
+		off = (off + count) % buffer_bytes;
+	}
+	pthread_join(producer, NULL);
+
+	free(r.data);
+	free(ring);
+	minivosc_signal_free(&sig);
+}
+
+int main(void)
+{
+	unsigned int f, c, wave, policy;
+
+	for (f = 0; f < ARRAY_SIZE(formats); f++)
+		for (c = 0; c < ARRAY_SIZE(channel_counts); c++) {
+			for (wave = MINIVOSC_WAVE_TABLE; wave <= MINIVOSC_WAVE_TRIANGLE; wave++) {
+				test_wrap(formats[f].format, channel_counts[c],
+				          wave, false, minivosc_gen);
+				// the image is only exact for the table wave;
+				// the oscillator accumulates the phase
+				if (wave == MINIVOSC_WAVE_TABLE) {
+					test_wrap(formats[f].format, channel_counts[c],
+					          wave, true, minivosc_gen);
+					test_wrap(formats[f].format, channel_counts[c],
+					          wave, true, minivosc_gen_words);
+				}
+			}
+			test_silence(formats[f].format, channel_counts[c]);
+			test_voices(formats[f].format, channel_counts[c], false);
+			test_voices(formats[f].format, channel_counts[c], true);
+		}
+	test_voices(SNDRV_PCM_FORMAT_S32_LE, 32, true);
+	for (wave = MINIVOSC_WAVE_TABLE; wave <= MINIVOSC_WAVE_TRIANGLE; wave++) {
+		test_late_fill(wave, false);
+		test_late_fill(wave, wave == MINIVOSC_WAVE_TABLE);
+	}
+	test_image_cycle();
+	test_lazy_mmap(true);
+	test_lazy_mmap(false);
+	for (f = 0; f < ARRAY_SIZE(formats); f++) {
+		test_image_share(formats[f].format, 2, MINIVOSC_WAVE_TABLE, false);
+		test_image_share(formats[f].format, 6, MINIVOSC_WAVE_SINE, false);
+		test_image_share(formats[f].format, 6, MINIVOSC_WAVE_SAW, true);
+	}
+	test_retune();
+	test_float();
+
+	test_probe(SNDRV_PCM_FORMAT_S16_LE, 2, -1, 100);
+	test_probe(SNDRV_PCM_FORMAT_S16_LE, 2, 1, 10);
+	test_probe(SNDRV_PCM_FORMAT_U8, 1, 0, 1);
+	test_probe(SNDRV_PCM_FORMAT_S24_LE, 6, 5, 333);
+	test_probe(SNDRV_PCM_FORMAT_FLOAT_LE, 32, -1, 7);
+
+	test_catchup(48000, 480, 1920, 3500000);
+	test_catchup(48000, 480, 1920, 999999999);
+	test_catchup(44100, 441, 44100, 2500000001ULL);
+	test_catchup(44100, 1024, 4096, 61ULL * NSEC_PER_SEC + 12345);
+	test_catchup(384000, 16, 65536, 3600ULL * NSEC_PER_SEC + 7);
+	test_catchup(8000, 65536, 65536 * 4, 17ULL * NSEC_PER_SEC);
+	test_drift(48000, 64);
+	test_drift(44100, 441);
+	test_drift(192000, 4096);
+
+	for (c = 0; c < ARRAY_SIZE(channel_counts); c++)
+		for (policy = MINIVOSC_INJECT_UNDERRUN_SILENCE;
+		     policy <= MINIVOSC_INJECT_UNDERRUN_OSC; policy++) {
+			test_inject(SNDRV_PCM_FORMAT_S16_LE, channel_counts[c], policy);
+			test_inject(SNDRV_PCM_FORMAT_U8, channel_counts[c], policy);
+		}
+	test_inject_thread();
+
+	if (failed) {
+		printf("%d check(s) failed\n", failed);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}